@@ -10,12 +10,15 @@
  *
  * =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
  ****/
+#pragma once
+
 typedef void                VOID;
 typedef void*               LPVOID;
 typedef unsigned long       DWORD;
 typedef const void*         LPCVOID;
 typedef long                LONG;
 typedef unsigned char       BYTE;
+typedef unsigned long long  ULONGLONG;
 #define  __int3264 long int
 typedef unsigned __int3264  ULONG_PTR;
 typedef ULONG_PTR           DWORD_PTR;
@@ -153,6 +156,7 @@ enum
     WINHTTP_CALLBACK_FLAG_HANDLES = 0x400000,
     WINHTTP_CALLBACK_FLAG_SECURE_FAILURE = 0x800000,
     WINHTTP_CALLBACK_FLAG_SEND_REQUEST = 0x1000000,
+    WINHTTP_CALLBACK_STATUS_SINK_COMPLETE = 0x20000000,
 };
 
 enum
@@ -173,8 +177,69 @@ enum
     WINHTTP_OPTION_AUTOLOGON_POLICY,
     WINHTTP_OPTION_ENABLE_FEATURE,
     WINHTTP_OPTION_SECURITY_FLAGS,
+    WINHTTP_OPTION_EVENT_LOOP_CALLBACKS,
+    WINHTTP_OPTION_INLINE_CALLBACKS,    // DWORD on an async session, status callbacks run on the engine thread
+    WINHTTP_OPTION_RESPONSE_SINK_FD,    // int on a request, see WINHTTP_SINK_RESULT
+    WINHTTP_OPTION_RESPONSE_SINK_PATH,  // file name on a request, length in characters, created or truncated
+    WINHTTP_OPTION_MAX_RESPONSE_BUFFER_SIZE,    // DWORD bytes on a session or request, see below
+    WINHTTP_OPTION_RECEIVE_BUFFER_SIZE, // DWORD bytes on a session or request, see below
+};
+
+// Size of the buffer curl receives into, one write callback per filled buffer. Up to curl's
+// CURL_MAX_READ_SIZE, 0 inherits from the session, then WINHTTP_PAL_RECEIVE_BUFFER_SIZE, then 16KB.
+// ADAPTIVE sizes each send from the bodies recently received on the session, large for bulk downloads
+// and small for many tiny responses, never above the response buffer cap. Applied on WinHttpSendRequest.
+#define WINHTTP_RECEIVE_BUFFER_SIZE_ADAPTIVE 0xFFFFFFFF
+
+// Caps the unread response body an async request keeps in memory. Once reached, the transfer is
+// paused until reads bring the buffer below half of it. The request value wins over the session's,
+// 0 falls back to WINHTTP_PAL_MAX_BUFFERED_BYTES. Applied on WinHttpSendRequest.
+
+// With a response sink set before WinHttpSendRequest, body bytes are written to it as they arrive and
+// are not available to WinHttpReadData. Async handles write from WINHTTP_PAL_SINK_THREADS writer threads,
+// pausing the transfer while the writer is behind, so the fd may block. A caller's fd stays open, a file
+// opened from a path is closed with the request. On async handles the transfer ends with
+// WINHTTP_CALLBACK_STATUS_SINK_COMPLETE carrying this, in place of REQUEST_ERROR on failures.
+// dwError is ERROR_WRITE_FAULT when writing failed, with the errno of the failed write in dwSystemError.
+typedef struct
+{
+    ULONGLONG ullBytesWritten;
+    DWORD dwError;
+    DWORD dwSystemError;
+} WINHTTP_SINK_RESULT;
+
+enum
+{
+    WINHTTP_EVENT_LOOP_IN = 0x1,
+    WINHTTP_EVENT_LOOP_OUT = 0x2,
+    WINHTTP_EVENT_LOOP_ERROR = 0x4,
+    WINHTTP_EVENT_LOOP_REMOVE = 0x8,
 };
 
+// dwEvents is a WINHTTP_EVENT_LOOP_* mask, WINHTTP_EVENT_LOOP_REMOVE means stop watching fd
+typedef VOID (* WINHTTP_EVENT_LOOP_SOCKET_CALLBACK)(
+    LPVOID pContext,
+    int fd,
+    DWORD dwEvents
+);
+
+// lTimeoutMs < 0 cancels the timer, otherwise call WinHttpProcessTimeout once it expires
+typedef VOID (* WINHTTP_EVENT_LOOP_TIMER_CALLBACK)(
+    LPVOID pContext,
+    long lTimeoutMs
+);
+
+// Passed with WINHTTP_OPTION_EVENT_LOOP_CALLBACKS on an async session before its first request is
+// sent. The session then gets its own transfer engine with no thread, driven by the caller through
+// WinHttpProcessSocket and WinHttpProcessTimeout. Both callbacks run from inside library calls and
+// should only update the caller's interest set or timer.
+typedef struct
+{
+    WINHTTP_EVENT_LOOP_SOCKET_CALLBACK pfnSocket;
+    WINHTTP_EVENT_LOOP_TIMER_CALLBACK pfnTimer;
+    LPVOID pContext;
+} WINHTTP_EVENT_LOOP_CALLBACKS;
+
 enum
 {
     SECURITY_FLAG_IGNORE_UNKNOWN_CA = 0x01,
@@ -230,6 +295,17 @@ WinHttpSetStatusCallback
     DWORD_PTR dwReserved
 );
 
+// Async request handles only. Replaces the status callback of this request, its notifications are
+// delivered from the engine thread at the end of each round instead of going through the callback
+// workers, as if WINHTTP_OPTION_INLINE_CALLBACKS was set. Takes effect on the next WinHttpSendRequest,
+// NULL goes back to the session settings.
+BOOL WinHttpSetCompletionRoutine
+(
+    HINTERNET hRequest,
+    WINHTTP_STATUS_CALLBACK lpfnCompletion,
+    DWORD dwNotificationFlags
+);
+
 BOOL WinHttpSetOption(
     HINTERNET hInternet,
     DWORD     dwOption,
@@ -248,6 +324,59 @@ BOOL WinHttpSendRequest
     DWORD_PTR dwContext
 );
 
+typedef struct
+{
+    HINTERNET hRequest;
+    LPCTSTR lpszHeaders;
+    DWORD dwHeadersLength;
+    LPVOID lpOptional;
+    DWORD dwOptionalLength;
+    DWORD dwTotalLength;
+    DWORD_PTR dwContext;
+    DWORD dwError;      // set on return, ERROR_SUCCESS when the request was submitted
+} WINHTTP_SEND_REQUEST_BATCH_ITEM;
+
+// Async request handles only. Every item is configured like WinHttpSendRequest, then all of
+// them are handed to the transfer engine together. Returns FALSE if any item failed.
+BOOL WinHttpSendRequestBatch
+(
+    WINHTTP_SEND_REQUEST_BATCH_ITEM *pItems,
+    DWORD dwCount
+);
+
+#define WINHTTP_CALLBACK_STATS_BUCKETS 32
+
+// Latency histograms of status callback delivery. Bucket 0 counts 0us, bucket i (i > 0) counts
+// latencies in [2^(i-1), 2^i) microseconds, the last bucket also takes everything longer.
+typedef struct
+{
+    DWORD dwInternetStatus;     // in: a single WINHTTP_CALLBACK_STATUS_* value, 0 for all of them
+    ULONGLONG ullDispatched;
+    ULONGLONG ullDiscarded;     // raised but dropped undelivered, e.g. queued when the dispatcher thread exited
+    ULONGLONG ullQueueWaitUs[WINHTTP_CALLBACK_STATS_BUCKETS];    // raised until the callback started
+    ULONGLONG ullExecutionUs[WINHTTP_CALLBACK_STATS_BUCKETS];    // time spent inside the callback
+    ULONGLONG ullQueueDepth;    // notifications raised but not dispatched yet, all statuses
+    ULONGLONG ullMaxQueueDepth;
+} WINHTTP_CALLBACK_STATS;
+
+BOOL WinHttpQueryCallbackStats
+(
+    WINHTTP_CALLBACK_STATS *pStats
+);
+
+// Called from the caller's event loop, one thread at a time per session.
+BOOL WinHttpProcessSocket
+(
+    HINTERNET hSession,
+    int fd,
+    DWORD dwEvents
+);
+
+BOOL WinHttpProcessTimeout
+(
+    HINTERNET hSession
+);
+
 BOOL
 WinHttpReadData
 (
@@ -257,6 +386,26 @@ WinHttpReadData
     LPDWORD lpdwNumberOfBytesRead
 );
 
+// Hands out the next received body bytes in place, inside the library's receive buffer, instead of
+// copying them like WinHttpReadData. The view stays valid until WinHttpReleaseData consumes dwLength
+// bytes of it, the rest is returned on the next call. One view per request at a time and no
+// WinHttpReadData while it is held. A length of 0 means the body is complete. On an async handle
+// FALSE with ERROR_IO_PENDING means nothing has arrived yet, wait for DATA_AVAILABLE.
+BOOL
+WinHttpReadDataBorrow
+(
+    HINTERNET hRequest,
+    LPCVOID *lplpBuffer,
+    LPDWORD lpdwLength
+);
+
+BOOL
+WinHttpReleaseData
+(
+    HINTERNET hRequest,
+    DWORD dwLength
+);
+
 BOOL WinHttpQueryHeaders(
     HINTERNET   hRequest,
     DWORD       dwInfoLevel,
@@ -406,6 +555,9 @@ enum
 #define ERROR_NOT_ENOUGH_MEMORY		ENOMEM
 #define ERROR_WINHTTP_TIMEOUT		ETIMEDOUT
 #define ERROR_INVALID_PARAMETER		EINVAL
+#define ERROR_IO_PENDING		EAGAIN
+#define ERROR_WINHTTP_INCORRECT_HANDLE_STATE	EALREADY
+#define ERROR_WRITE_FAULT		EIO
 
 #include <memory>
 
@@ -0,0 +1,323 @@
+/***
+ * Copyright (C) Microsoft. All rights reserved.
+ * Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+ *
+ * =+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+
+ *
+ * HTTP Library: awaitable and future based wrappers over asynchronous request handles.
+ *
+ * Completions are raised through WinHttpSetCompletionRoutine, so coroutines resume and futures are
+ * fulfilled directly on the engine thread without a hop through the callback workers. Code running
+ * there holds up every other transfer of that engine, hand long work to your own executor.
+ *
+ * =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+ ****/
+#pragma once
+
+#include "winhttppal.h"
+
+#include <errno.h>
+#include <atomic>
+#include <future>
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#define WINHTTPPAL_COROUTINES 1
+#endif
+#endif
+
+namespace winhttppal {
+
+struct AsyncResult
+{
+    DWORD dwError = ERROR_SUCCESS;
+
+    // bytes available, read or written, depending on the operation
+    DWORD dwLength = 0;
+
+    bool Succeeded() const { return dwError == ERROR_SUCCESS; }
+};
+
+// receives the completion of the operation in flight, on the engine thread
+class AsyncWaiter
+{
+public:
+    virtual void Complete(const AsyncResult &result) = 0;
+
+protected:
+    ~AsyncWaiter() {}
+};
+
+// Owns an asynchronous request handle and takes over its status callback and context value. One
+// operation may be in flight at a time, like with the plain callback API. The handle is closed on
+// destruction, the completion state lives on until WINHTTP_CALLBACK_STATUS_HANDLE_CLOSING.
+class AsyncRequest
+{
+    struct Operation
+    {
+        int m_Api;
+        LPVOID m_Buffer;
+        DWORD m_Length;
+        DWORD m_TotalLength;
+    };
+
+    class State
+    {
+        std::atomic<AsyncWaiter *> m_Waiter{nullptr};
+        DWORD m_Expected = 0;
+
+    public:
+        // false with failure filled in when the call failed and no completion will come
+        bool Issue(HINTERNET hRequest, const Operation &op, AsyncWaiter *waiter, AsyncResult &failure)
+        {
+            m_Expected = ExpectedStatus(op.m_Api);
+            m_Waiter.store(waiter, std::memory_order_release);
+
+            if (Start(hRequest, op))
+                return true;
+
+            // the engine may have raised an error for it already, whoever takes the waiter completes it
+            AsyncWaiter *expected = waiter;
+            if (!m_Waiter.compare_exchange_strong(expected, nullptr, std::memory_order_acq_rel))
+                return true;
+
+            failure.dwError = GetLastError() ? GetLastError() : ERROR_WINHTTP_OPERATION_CANCELLED;
+            return false;
+        }
+
+        void Complete(DWORD dwInternetStatus, const AsyncResult &result)
+        {
+            AsyncWaiter *waiter = m_Waiter.load(std::memory_order_acquire);
+
+            if (!waiter)
+                return;
+
+            if ((dwInternetStatus != m_Expected) && result.Succeeded())
+                return;
+
+            if (m_Waiter.compare_exchange_strong(waiter, nullptr, std::memory_order_acq_rel))
+                waiter->Complete(result);
+        }
+
+    private:
+        static DWORD ExpectedStatus(int api)
+        {
+            switch (api)
+            {
+            case API_SEND_REQUEST: return WINHTTP_CALLBACK_STATUS_SENDREQUEST_COMPLETE;
+            case API_RECEIVE_RESPONSE: return WINHTTP_CALLBACK_STATUS_HEADERS_AVAILABLE;
+            case API_QUERY_DATA_AVAILABLE: return WINHTTP_CALLBACK_STATUS_DATA_AVAILABLE;
+            case API_READ_DATA: return WINHTTP_CALLBACK_STATUS_READ_COMPLETE;
+            case API_WRITE_DATA: return WINHTTP_CALLBACK_STATUS_WRITE_COMPLETE;
+            }
+            return 0;
+        }
+
+        BOOL Start(HINTERNET hRequest, const Operation &op)
+        {
+            errno = 0;
+            switch (op.m_Api)
+            {
+            case API_SEND_REQUEST:
+                return WinHttpSendRequest(hRequest, NULL, 0, op.m_Buffer, op.m_Length, op.m_TotalLength,
+                                          reinterpret_cast<DWORD_PTR>(this));
+            case API_RECEIVE_RESPONSE:
+                return WinHttpReceiveResponse(hRequest, NULL);
+            case API_QUERY_DATA_AVAILABLE:
+                return WinHttpQueryDataAvailable(hRequest, NULL);
+            case API_READ_DATA:
+                return WinHttpReadData(hRequest, op.m_Buffer, op.m_Length, NULL);
+            case API_WRITE_DATA:
+                return WinHttpWriteData(hRequest, op.m_Buffer, op.m_Length, NULL);
+            }
+            return FALSE;
+        }
+    };
+
+    HINTERNET m_Request = NULL;
+    State *m_State = nullptr;
+
+    static VOID CALLBACK CompletionRoutine(HINTERNET, DWORD_PTR dwContext, DWORD dwInternetStatus,
+                                           LPVOID lpvStatusInformation, DWORD dwStatusInformationLength)
+    {
+        State *state = reinterpret_cast<State *>(dwContext);
+        AsyncResult result;
+
+        if (!state)
+            return;
+
+        switch (dwInternetStatus)
+        {
+        case WINHTTP_CALLBACK_STATUS_DATA_AVAILABLE:
+        case WINHTTP_CALLBACK_STATUS_WRITE_COMPLETE:
+            result.dwLength = *static_cast<DWORD *>(lpvStatusInformation);
+            break;
+        case WINHTTP_CALLBACK_STATUS_READ_COMPLETE:
+            result.dwLength = dwStatusInformationLength;
+            break;
+        case WINHTTP_CALLBACK_STATUS_REQUEST_ERROR:
+            result.dwError = static_cast<WINHTTP_ASYNC_RESULT *>(lpvStatusInformation)->dwError;
+            if (result.dwError == ERROR_SUCCESS)
+                result.dwError = ERROR_WINHTTP_OPERATION_CANCELLED;
+            break;
+        case WINHTTP_CALLBACK_STATUS_HANDLE_CLOSING:
+            // last notification of the handle, abandon whatever was still in flight
+            result.dwError = ERROR_OPERATION_ABORTED;
+            state->Complete(dwInternetStatus, result);
+            delete state;
+            return;
+        }
+        state->Complete(dwInternetStatus, result);
+    }
+
+    class FutureWaiter final : public AsyncWaiter
+    {
+    public:
+        std::promise<AsyncResult> m_Promise;
+
+        void Complete(const AsyncResult &result) override
+        {
+            m_Promise.set_value(result);
+            delete this;
+        }
+    };
+
+    std::future<AsyncResult> Launch(const Operation &op)
+    {
+        FutureWaiter *waiter = new FutureWaiter;
+        std::future<AsyncResult> future = waiter->m_Promise.get_future();
+        AsyncResult failure;
+
+        if (!Issue(op, waiter, failure))
+            waiter->Complete(failure);
+        return future;
+    }
+
+    // a moved-from request has no handle left to issue on
+    bool Issue(const Operation &op, AsyncWaiter *waiter, AsyncResult &failure)
+    {
+        if (!m_State)
+        {
+            failure.dwError = ERROR_WINHTTP_INCORRECT_HANDLE_STATE;
+            return false;
+        }
+        return m_State->Issue(m_Request, op, waiter, failure);
+    }
+
+    void Close()
+    {
+        // the state goes with HANDLE_CLOSING
+        if (m_Request)
+            WinHttpCloseHandle(m_Request);
+        m_Request = NULL;
+        m_State = nullptr;
+    }
+
+public:
+    explicit AsyncRequest(HINTERNET hRequest) : m_Request(hRequest), m_State(new State)
+    {
+        void *context = m_State;
+
+        // before any notification, HANDLE_CLOSING of a request that was never sent needs it too
+        WinHttpSetOption(m_Request, WINHTTP_OPTION_CONTEXT_VALUE, &context, sizeof(context));
+        WinHttpSetCompletionRoutine(m_Request, CompletionRoutine,
+                                    WINHTTP_CALLBACK_FLAG_ALL_COMPLETIONS | WINHTTP_CALLBACK_FLAG_HANDLES);
+    }
+
+    AsyncRequest(AsyncRequest &&other) noexcept : m_Request(other.m_Request), m_State(other.m_State)
+    {
+        other.m_Request = NULL;
+        other.m_State = nullptr;
+    }
+
+    AsyncRequest &operator=(AsyncRequest &&other) noexcept
+    {
+        if (this != &other)
+        {
+            Close();
+            m_Request = other.m_Request;
+            m_State = other.m_State;
+            other.m_Request = NULL;
+            other.m_State = nullptr;
+        }
+        return *this;
+    }
+
+    AsyncRequest(const AsyncRequest &) = delete;
+    AsyncRequest &operator=(const AsyncRequest &) = delete;
+
+    ~AsyncRequest() { Close(); }
+
+    HINTERNET GetHandle() const { return m_Request; }
+
+    std::future<AsyncResult> SendRequestAsync(LPVOID lpOptional = NULL, DWORD dwOptionalLength = 0, DWORD dwTotalLength = 0)
+    {
+        return Launch({ API_SEND_REQUEST, lpOptional, dwOptionalLength, dwTotalLength });
+    }
+
+    std::future<AsyncResult> ReceiveResponseAsync() { return Launch({ API_RECEIVE_RESPONSE, NULL, 0, 0 }); }
+    std::future<AsyncResult> QueryDataAvailableAsync() { return Launch({ API_QUERY_DATA_AVAILABLE, NULL, 0, 0 }); }
+
+    std::future<AsyncResult> ReadDataAsync(LPVOID lpBuffer, DWORD dwNumberOfBytesToRead)
+    {
+        return Launch({ API_READ_DATA, lpBuffer, dwNumberOfBytesToRead, 0 });
+    }
+
+    std::future<AsyncResult> WriteDataAsync(LPCVOID lpBuffer, DWORD dwNumberOfBytesToWrite)
+    {
+        return Launch({ API_WRITE_DATA, const_cast<LPVOID>(lpBuffer), dwNumberOfBytesToWrite, 0 });
+    }
+
+#ifdef WINHTTPPAL_COROUTINES
+    // resumes the awaiting coroutine on the engine thread, or inline if the call failed right away
+    class Awaiter : private AsyncWaiter
+    {
+        AsyncRequest &m_Owner;
+        Operation m_Operation;
+        AsyncResult m_Result;
+        std::coroutine_handle<> m_Handle;
+
+        void Complete(const AsyncResult &result) override
+        {
+            m_Result = result;
+            m_Handle.resume();
+        }
+
+    public:
+        Awaiter(AsyncRequest &owner, const Operation &op) : m_Owner(owner), m_Operation(op) {}
+
+        bool await_ready() const noexcept { return false; }
+
+        bool await_suspend(std::coroutine_handle<> handle)
+        {
+            m_Handle = handle;
+
+            // once issued the coroutine may be resumed on the engine thread before this returns
+            return m_Owner.Issue(m_Operation, this, m_Result);
+        }
+
+        AsyncResult await_resume() const noexcept { return m_Result; }
+    };
+
+    Awaiter SendRequest(LPVOID lpOptional = NULL, DWORD dwOptionalLength = 0, DWORD dwTotalLength = 0)
+    {
+        return Awaiter(*this, { API_SEND_REQUEST, lpOptional, dwOptionalLength, dwTotalLength });
+    }
+
+    Awaiter ReceiveResponse() { return Awaiter(*this, { API_RECEIVE_RESPONSE, NULL, 0, 0 }); }
+    Awaiter QueryDataAvailable() { return Awaiter(*this, { API_QUERY_DATA_AVAILABLE, NULL, 0, 0 }); }
+
+    Awaiter ReadData(LPVOID lpBuffer, DWORD dwNumberOfBytesToRead)
+    {
+        return Awaiter(*this, { API_READ_DATA, lpBuffer, dwNumberOfBytesToRead, 0 });
+    }
+
+    Awaiter WriteData(LPCVOID lpBuffer, DWORD dwNumberOfBytesToWrite)
+    {
+        return Awaiter(*this, { API_WRITE_DATA, const_cast<LPVOID>(lpBuffer), dwNumberOfBytesToWrite, 0 });
+    }
+#endif
+};
+
+} // namespace winhttppal
@@ -20,9 +20,11 @@
 #include <thread>
 #include <algorithm>
 #include <map>
+#include <unordered_map>
 #include <condition_variable>
 #include <future>
 #include <queue>
+#include <deque>
 #include <chrono>
 #include <ctime>
 #include <string.h>
@@ -55,6 +57,18 @@
 #else
 #include <pthread.h>
 #include <unistd.h>
+#include <fcntl.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <linux/futex.h>
+#else
+#include <poll.h>
+#endif
 #include "winhttppal.h"
 #endif
 
@@ -64,6 +78,10 @@
 #define WINHTTP_CURL_MAX_WRITE_SIZE CURL_MAX_WRITE_SIZE
 #endif
 
+#ifndef WINHTTP_EPOLL_MAX_EVENTS
+#define WINHTTP_EPOLL_MAX_EVENTS 256
+#endif
+
 class WinHttpSessionImp;
 class WinHttpRequestImp;
 
@@ -153,6 +171,33 @@ enum
 
 static int winhttp_tracing = false;
 static int winhttp_tracing_verbose = false;
+static int winhttp_engine_shards = 1;
+static int winhttp_engine_policy = WINHTTP_ENGINE_POLICY_HOST_HASH;
+static long winhttp_max_host_connections = 0;
+static long winhttp_max_total_connections = 0;
+static int winhttp_multiplex = true;
+static int winhttp_callback_threads = 1;
+static long winhttp_max_pending_notifications = 0;
+static size_t winhttp_max_buffered_bytes = 0;
+static DWORD winhttp_receive_buffer_size = 0;
+static int winhttp_sink_threads = 2;
+
+// an async sink without a response buffer cap pauses its transfer past this much unwritten body
+static const size_t WINHTTP_SINK_BUFFER_LIMIT = 4 * 1024 * 1024;
+
+struct ThreadPlacement
+{
+    const char *m_Name;
+    std::vector<int> m_Cpus;
+    int m_Priority = 0;
+    bool m_HasPriority = false;
+
+    explicit ThreadPlacement(const char *name): m_Name(name) {}
+};
+static ThreadPlacement winhttp_thread_placement[WINHTTP_THREAD_KINDS] = {
+    ThreadPlacement("engine"), ThreadPlacement("cb"), ThreadPlacement("upload"), ThreadPlacement("sink")
+};
+static size_t winhttp_thread_stack_size = 0;
 
 #ifdef _MSC_VER
 int gettimeofday(struct timeval * tp, struct timezone * tzp);
@@ -211,7 +256,6 @@ static void TRACE_INTERNAL(const char *fmt, ...)
 
 #define MUTEX_TYPE                              std::mutex
 #define MUTEX_SETUP(x)
-#define MUTEX_CLEANUP(x)
 #define MUTEX_LOCK(x)                           x.lock()
 #define MUTEX_UNLOCK(x)                         x.unlock()
 
@@ -252,23 +296,6 @@ static int thread_setup()
     return 1;
 }
 
-static int thread_cleanup()
-{
-#if OPENSSL_VERSION_NUMBER < 0x10100000L
-    int i;
-
-    if (!mutex_buf)
-        return 0;
-    CRYPTO_set_id_callback(NULL);
-    CRYPTO_set_locking_callback(NULL);
-    for (i = 0; i < CRYPTO_num_locks(); i++)
-        MUTEX_CLEANUP(mutex_buf[i]);
-    delete [] mutex_buf;
-    mutex_buf = NULL;
-#endif
-    return 1;
-}
-
 static void ConvertCstrAssign(const TCHAR *lpstr, size_t cLen, std::string &target)
 {
 #ifdef UNICODE
@@ -431,6 +458,44 @@ static BufferRequest &PeekBufferRequest(std::vector<BufferRequest> &store)
     return store.front();
 }
 
+#ifdef __linux__
+#define WINHTTP_MAX_CPUS CPU_SETSIZE
+#else
+#define WINHTTP_MAX_CPUS 1024
+#endif
+
+// "0-3,8" -> 0 1 2 3 8, ids a cpu_set_t can't hold are ignored
+static std::vector<int> ParseCpuList(const std::string &list)
+{
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string item;
+
+    while (std::getline(ss, item, ','))
+    {
+        size_t dash = item.find('-');
+
+        // a leading dash is a negative id
+        if (item.empty() || (dash == 0))
+        {
+            TRACE("%-35s:%-8d:%-16p ignoring cpu:%s\n", __func__, __LINE__, (void*)NULL, item.c_str());
+            continue;
+        }
+
+        int first = std::stoi(item.substr(0, dash));
+        int last = (dash == std::string::npos) ? first : std::stoi(item.substr(dash + 1));
+        if ((first < 0) || (last >= WINHTTP_MAX_CPUS))
+        {
+            TRACE("%-35s:%-8d:%-16p ignoring cpu:%s\n", __func__, __LINE__, (void*)NULL, item.c_str());
+            continue;
+        }
+
+        for (int cpu = first; cpu <= last; cpu++)
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
 EnvInit::EnvInit()
 {
     if (const char* env_p = std::getenv("WINHTTP_PAL_DEBUG"))
@@ -438,435 +503,388 @@ EnvInit::EnvInit()
 
     if (const char* env_p = std::getenv("WINHTTP_PAL_DEBUG_VERBOSE"))
         winhttp_tracing_verbose = std::stoi(std::string(env_p));
-}
 
-static EnvInit envinit;
-
-THREADRETURN UserCallbackContainer::UserCallbackThreadFunction(LPVOID lpThreadParameter)
-{
-    UserCallbackContainer *cbContainer = static_cast<UserCallbackContainer *>(lpThreadParameter);
+    // number of engine threads, 0 means one per core
+    if (const char* env_p = std::getenv("WINHTTP_PAL_ENGINE_SHARDS"))
+        winhttp_engine_shards = std::stoi(std::string(env_p));
 
-    while (true)
+    if (const char* env_p = std::getenv("WINHTTP_PAL_ENGINE_POLICY"))
     {
-        {
-            std::unique_lock<std::mutex> GetEventHndlMtx(cbContainer->m_hEventMtx);
-            while (!cbContainer->m_EventCounter)
-                cbContainer->m_hEvent.wait(GetEventHndlMtx);
-            GetEventHndlMtx.unlock();
+        if (std::string(env_p) == "leastloaded")
+            winhttp_engine_policy = WINHTTP_ENGINE_POLICY_LEAST_LOADED;
+        else
+            winhttp_engine_policy = WINHTTP_ENGINE_POLICY_HOST_HASH;
+    }
 
-            cbContainer->m_EventCounter--;
-        }
+    // connection caps per engine, 0 means unlimited, transfers over the cap wait in libcurl's pending queue
+    if (const char* env_p = std::getenv("WINHTTP_PAL_MAX_HOST_CONNECTIONS"))
+        winhttp_max_host_connections = std::stol(std::string(env_p));
 
-        if (cbContainer->GetClosing())
-        {
-            TRACE("%s", "exiting\n");
-            break;
-        }
+    if (const char* env_p = std::getenv("WINHTTP_PAL_MAX_TOTAL_CONNECTIONS"))
+        winhttp_max_total_connections = std::stol(std::string(env_p));
 
-        while (true)
-        {
-            cbContainer->m_MapMutex.lock();
-            UserCallbackContext *ctx = NULL;
-            ctx = cbContainer->GetNext();
-            cbContainer->m_MapMutex.unlock();
-            if (!ctx)
-                break;
+    // number of callback dispatcher threads, 0 means one per core
+    if (const char* env_p = std::getenv("WINHTTP_PAL_CALLBACK_THREADS"))
+        winhttp_callback_threads = std::stoi(std::string(env_p));
 
-            void *statusInformation = NULL;
+    // per request high watermarks, past either one the transfer is paused until the app catches up
+    if (const char* env_p = std::getenv("WINHTTP_PAL_MAX_PENDING_NOTIFICATIONS"))
+        winhttp_max_pending_notifications = std::stol(std::string(env_p));
 
-            if (ctx->GetStatusInformationValid())
-                statusInformation = ctx->GetStatusInformation();
+    if (const char* env_p = std::getenv("WINHTTP_PAL_MAX_BUFFERED_BYTES"))
+        winhttp_max_buffered_bytes = std::stoul(std::string(env_p));
+
+    // bytes, or "adaptive"
+    if (const char* env_p = std::getenv("WINHTTP_PAL_RECEIVE_BUFFER_SIZE"))
+    {
+        if (std::string(env_p) == "adaptive")
+            winhttp_receive_buffer_size = WINHTTP_RECEIVE_BUFFER_SIZE_ADAPTIVE;
+        else
+            winhttp_receive_buffer_size = MIN(std::stoul(std::string(env_p)), static_cast<unsigned long>(CURL_MAX_READ_SIZE));
+    }
 
-            if (!ctx->GetRequestRef()->GetClosed() && ctx->GetCb()) {
-                TRACE_VERBOSE("%-35s:%-8d:%-16p ctx = %p cb = %p ctx->GetUserdata() = %p dwInternetStatus:0x%lx statusInformation=%p refcount:%lu\n",
-                    __func__, __LINE__, (void*)ctx->GetRequest(), reinterpret_cast<void*>(ctx), reinterpret_cast<void*>(ctx->GetCb()),
-                    ctx->GetUserdata(), ctx->GetInternetStatus(), statusInformation, ctx->GetRequestRef().use_count());
+    if (const char* env_p = std::getenv("WINHTTP_PAL_MULTIPLEX"))
+        winhttp_multiplex = std::stoi(std::string(env_p));
 
-                ctx->GetCb()(ctx->GetRequest(),
-                    (DWORD_PTR)(ctx->GetUserdata()),
-                    ctx->GetInternetStatus(),
-                    statusInformation,
-                    ctx->GetStatusInformationLength());
+    // number of threads writing async response sinks
+    if (const char* env_p = std::getenv("WINHTTP_PAL_SINK_THREADS"))
+        winhttp_sink_threads = std::stoi(std::string(env_p));
 
-                TRACE_VERBOSE("%-35s:%-8d:%-16p ctx = %p cb = %p ctx->GetUserdata() = %p dwInternetStatus:0x%lx statusInformation=%p refcount:%lu\n",
-                    __func__, __LINE__, (void*)ctx->GetRequest(), reinterpret_cast<void*>(ctx), reinterpret_cast<void*>(ctx->GetCb()),
-                    ctx->GetUserdata(), ctx->GetInternetStatus(), statusInformation, ctx->GetRequestRef().use_count());
-            }
-            ctx->GetRequestCompletionCb()(ctx->GetRequestRef(), ctx->GetInternetStatus());
-            delete ctx;
+    // thread placement, e.g. WINHTTP_PAL_ENGINE_CPUS=0-7 WINHTTP_PAL_ENGINE_PRIORITY=-5
+    static const char *placementEnv[WINHTTP_THREAD_KINDS][2] = {
+        { "WINHTTP_PAL_ENGINE_CPUS", "WINHTTP_PAL_ENGINE_PRIORITY" },
+        { "WINHTTP_PAL_CALLBACK_CPUS", "WINHTTP_PAL_CALLBACK_PRIORITY" },
+        { "WINHTTP_PAL_UPLOAD_CPUS", "WINHTTP_PAL_UPLOAD_PRIORITY" },
+        { "WINHTTP_PAL_SINK_CPUS", "WINHTTP_PAL_SINK_PRIORITY" },
+    };
+    for (int kind = 0; kind < WINHTTP_THREAD_KINDS; kind++)
+    {
+        ThreadPlacement &placement = winhttp_thread_placement[kind];
+
+        if (const char* env_p = std::getenv(placementEnv[kind][0]))
+            placement.m_Cpus = ParseCpuList(std::string(env_p));
+
+        if (const char* env_p = std::getenv(placementEnv[kind][1]))
+        {
+            placement.m_Priority = std::stoi(std::string(env_p));
+            placement.m_HasPriority = true;
         }
     }
 
-#if OPENSSL_VERSION_NUMBER >= 0x10000000L && OPENSSL_VERSION_NUMBER < 0x10100000L
-    ERR_remove_thread_state(NULL);
-#elif OPENSSL_VERSION_NUMBER < 0x10000000L
-    ERR_remove_state(0);
+    if (const char* env_p = std::getenv("WINHTTP_PAL_THREAD_STACK_SIZE"))
+        winhttp_thread_stack_size = std::stoul(std::string(env_p));
+}
+
+static EnvInit envinit;
+
+#ifndef WINHTTP_CONTEXT_MAGAZINE_SIZE
+#define WINHTTP_CONTEXT_MAGAZINE_SIZE 64
 #endif
 
-    return 0;
-}
+#ifndef WINHTTP_CONTEXT_DEPOT_SIZE
+#define WINHTTP_CONTEXT_DEPOT_SIZE 64
+#endif
 
-UserCallbackContext* UserCallbackContainer::GetNext()
+// a batch of free UserCallbackContext blocks, moved between threads as a whole
+struct ContextMagazine
 {
-    UserCallbackContext *ctx = NULL;
-    // show content:
-    if (!GetCallbackQueue().empty())
-    {
-        ctx = GetCallbackQueue().front();
-        GetCallbackQueue().erase(GetCallbackQueue().begin());
-    }
-
-    return ctx;
-}
+    size_t m_Count = 0;
+    void *m_Objects[WINHTTP_CONTEXT_MAGAZINE_SIZE];
+};
 
-BOOL UserCallbackContainer::Queue(UserCallbackContext *ctx)
+// contexts are allocated on the engine and API threads but freed on the callback workers,
+// full magazines travel from the freeing threads back to the allocating ones through here
+class ContextDepot
 {
-    if (!ctx)
-        return FALSE;
+    std::mutex m_Mtx;
+    std::vector<ContextMagazine *> m_Full;
+    std::vector<ContextMagazine *> m_Empty;
 
+public:
+    static ContextDepot &Instance()
     {
-        std::lock_guard<std::mutex> lck(m_MapMutex);
-
-        TRACE_VERBOSE("%-35s:%-8d:%-16p ctx = %p cb = %p userdata = %p dwInternetStatus = %p\n",
-            __func__, __LINE__, (void*)ctx->GetRequest(), reinterpret_cast<void*>(ctx), reinterpret_cast<void*>(ctx->GetCb()),
-            ctx->GetUserdata(), ctx->GetStatusInformation());
-        GetCallbackQueue().push_back(ctx);
+        // never destroyed, thread_local caches hand their magazines back during thread exit
+        static ContextDepot *the_instance = new ContextDepot();
+        return *the_instance;
     }
+
+    // trade an empty magazine for a full one, NULL when the depot has none
+    ContextMagazine *TakeFull(ContextMagazine *empty)
     {
-        std::lock_guard<std::mutex> lck(m_hEventMtx);
-        m_EventCounter++;
-        m_hEvent.notify_all();
+        std::lock_guard<std::mutex> lck(m_Mtx);
+
+        if (m_Full.empty())
+            return NULL;
+
+        ContextMagazine *full = m_Full.back();
+        m_Full.pop_back();
+        m_Empty.push_back(empty);
+        return full;
     }
-    return TRUE;
-}
 
-void UserCallbackContainer::DrainQueue()
-{
-    while (true)
+    // trade a full magazine for an empty one
+    ContextMagazine *PutFull(ContextMagazine *full)
     {
-        m_MapMutex.lock();
-        UserCallbackContext *ctx = GetNext();
-        m_MapMutex.unlock();
+        {
+            std::lock_guard<std::mutex> lck(m_Mtx);
 
-        if (!ctx)
-            break;
+            if (m_Full.size() < WINHTTP_CONTEXT_DEPOT_SIZE)
+            {
+                m_Full.push_back(full);
+                if (m_Empty.empty())
+                    return new ContextMagazine();
 
-        delete ctx;
+                ContextMagazine *empty = m_Empty.back();
+                m_Empty.pop_back();
+                return empty;
+            }
+        }
+
+        // depot is full, give the memory back
+        while (full->m_Count)
+            ::operator delete(full->m_Objects[--full->m_Count]);
+        return full;
     }
-}
+};
 
-CURL *ComContainer::AllocCURL()
+// trivially destructible so it stays usable after ContextCacheFlusher ran at thread exit
+static thread_local ContextMagazine *winhttp_context_magazine = NULL;
+static thread_local bool winhttp_context_cache_closed = false;
+
+struct ContextCacheFlusher
 {
-    CURL *ptr;
+    ~ContextCacheFlusher()
+    {
+        ContextMagazine *loaded = winhttp_context_magazine;
 
-    m_MultiMutex.lock();
-    ptr = curl_easy_init();
-    m_MultiMutex.unlock();
+        winhttp_context_magazine = NULL;
+        winhttp_context_cache_closed = true;
+        if (loaded && loaded->m_Count)
+            delete ContextDepot::Instance().PutFull(loaded);
+        else
+            delete loaded;
+    }
+};
 
-    return ptr;
-}
+static thread_local ContextCacheFlusher winhttp_context_flusher;
 
-void ComContainer::FreeCURL(CURL *ptr)
+// NULL once the thread is exiting, callers fall back to the global heap
+static ContextMagazine *GetContextMagazine()
 {
-    m_MultiMutex.lock();
-    curl_easy_cleanup(ptr);
-    m_MultiMutex.unlock();
+    if (!winhttp_context_magazine && !winhttp_context_cache_closed)
+    {
+        (void)&winhttp_context_flusher;
+        winhttp_context_magazine = new ContextMagazine();
+    }
+    return winhttp_context_magazine;
 }
 
-ComContainer &ComContainer::GetInstance()
+void *UserCallbackContext::operator new(size_t size)
 {
-    static ComContainer *the_instance = new ComContainer();
-    return *the_instance;
-}
+    ContextMagazine *loaded = GetContextMagazine();
 
-void ComContainer::ResumeTransfer(CURL *handle, int bitmask)
-{
-    int still_running;
+    if (!loaded || (size != sizeof(UserCallbackContext)))
+        return ::operator new(size);
 
-    m_MultiMutex.lock();
-    curl_easy_pause(handle, bitmask);
-    curl_multi_perform(m_curlm, &still_running);
-    m_MultiMutex.unlock();
+    if (!loaded->m_Count)
+    {
+        ContextMagazine *full = ContextDepot::Instance().TakeFull(loaded);
+        if (!full)
+            return ::operator new(size);
+        winhttp_context_magazine = loaded = full;
+    }
+    return loaded->m_Objects[--loaded->m_Count];
 }
 
-BOOL ComContainer::AddHandle(std::shared_ptr<WinHttpRequestImp> &srequest, CURL *handle)
+void UserCallbackContext::operator delete(void *ptr, size_t size)
 {
-    CURLMcode mres = CURLM_OK;
+    if (!ptr)
+        return;
 
-    m_MultiMutex.lock();
-    if (std::find(m_ActiveCurl.begin(), m_ActiveCurl.end(), handle) != m_ActiveCurl.end()) {
-        mres = curl_multi_remove_handle(m_curlm, handle);
-        m_ActiveCurl.erase(std::remove(m_ActiveCurl.begin(), m_ActiveCurl.end(), handle), m_ActiveCurl.end());
-    }
-    if (std::find(m_ActiveRequests.begin(), m_ActiveRequests.end(), srequest) != m_ActiveRequests.end()) {
-        m_ActiveRequests.erase(std::remove(m_ActiveRequests.begin(), m_ActiveRequests.end(), srequest), m_ActiveRequests.end());
-    }
-    m_MultiMutex.unlock();
-    if (mres != CURLM_OK)
-    {
-        TRACE("curl_multi_remove_handle() failed: %s\n", curl_multi_strerror(mres));
-        return FALSE;
-    }
+    ContextMagazine *loaded = GetContextMagazine();
 
-    m_MultiMutex.lock();
-    mres = curl_multi_add_handle(m_curlm, handle);
-    m_ActiveCurl.push_back(handle);
-    m_ActiveRequests.push_back(srequest);
-    m_MultiMutex.unlock();
-    if (mres != CURLM_OK)
+    if (!loaded || (size != sizeof(UserCallbackContext)))
     {
-        TRACE("curl_multi_add_handle() failed: %s\n", curl_multi_strerror(mres));
-        return FALSE;
+        ::operator delete(ptr);
+        return;
     }
 
-    return TRUE;
+    if (loaded->m_Count == WINHTTP_CONTEXT_MAGAZINE_SIZE)
+        winhttp_context_magazine = loaded = ContextDepot::Instance().PutFull(loaded);
+    loaded->m_Objects[loaded->m_Count++] = ptr;
 }
 
-BOOL ComContainer::RemoveHandle(std::shared_ptr<WinHttpRequestImp> &srequest, CURL *handle, bool clearPrivate)
+CallbackStats::CallbackStats()
 {
-    CURLMcode mres;
-
-    m_MultiMutex.lock();
-    mres = curl_multi_remove_handle(m_curlm, handle);
-
-    if (clearPrivate)
-        curl_easy_getinfo(handle, CURLINFO_PRIVATE, NULL);
-
-    m_ActiveCurl.erase(std::remove(m_ActiveCurl.begin(), m_ActiveCurl.end(), handle), m_ActiveCurl.end());
-    m_ActiveRequests.erase(std::remove(m_ActiveRequests.begin(), m_ActiveRequests.end(), srequest), m_ActiveRequests.end());
-    m_MultiMutex.unlock();
-    if (mres != CURLM_OK)
+    for (auto &histograms : m_Status)
     {
-        TRACE("curl_multi_add_handle() failed: %s\n", curl_multi_strerror(mres));
-        return FALSE;
+        for (int i = 0; i < WINHTTP_CALLBACK_STATS_BUCKETS; i++)
+        {
+            histograms.m_Wait[i] = 0;
+            histograms.m_Run[i] = 0;
+        }
     }
-
-    return TRUE;
 }
 
-void ComContainer::KickStart()
+CallbackStats &CallbackStats::Instance()
 {
-    std::lock_guard<std::mutex> lck(m_hAsyncEventMtx);
-    m_hAsyncEventCounter++;
-    m_hAsyncEvent.notify_all();
+    static CallbackStats *the_instance = new CallbackStats();
+    return *the_instance;
 }
 
-ComContainer::ComContainer(): m_hAsyncEventCounter(0)
+// 0 -> 0, 1 -> 1, 2..3 -> 2, 4..7 -> 3 ...
+static int LatencyBucket(std::chrono::steady_clock::duration latency)
 {
-    curl_global_init(CURL_GLOBAL_ALL);
-    thread_setup();
+    long long us = std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+    int bucket = 0;
 
-    m_curlm = curl_multi_init();
-
-    DWORD thread_id;
-    m_hAsyncThread = CREATETHREAD(
-        AsyncThreadFunction,       // thread function name
-        this, &thread_id);          // argument to thread function
-}
-
-ComContainer::~ComContainer()
-{
-    TRACE("%-35s:%-8d:%-16p\n", __func__, __LINE__, (void*)this);
-    m_closing = true;
+    while ((us > 0) && (bucket < WINHTTP_CALLBACK_STATS_BUCKETS - 1))
     {
-        std::lock_guard<std::mutex> lck(m_hAsyncEventMtx);
-        m_hAsyncEventCounter++;
-        m_hAsyncEvent.notify_all();
+        us >>= 1;
+        bucket++;
     }
-    THREADJOIN(m_hAsyncThread);
-    TRACE("%-35s:%-8d:%-16p\n", __func__, __LINE__, (void*)this);
-
-    curl_multi_cleanup(m_curlm);
-    curl_global_cleanup();
-    thread_cleanup();
+    return bucket;
 }
 
-template<class T>
-void WinHttpHandleContainer<T>::UnRegister(T *val)
+static int StatusSlot(DWORD dwInternetStatus)
 {
-    typedef std::shared_ptr<T> t_shared;
-    typename std::vector<t_shared>::iterator findit;
-    bool found = false;
-    std::lock_guard<std::mutex> lck(m_ActiveRequestMtx);
-
-    TRACE("%-35s:%-8d:%-16p\n", __func__, __LINE__, (void*)val);
+    int slot = 0;
 
-    for (auto it = m_ActiveRequests.begin(); it != m_ActiveRequests.end(); ++it)
+    while ((dwInternetStatus > 1) && (slot < 31))
     {
-        auto v = (*it);
-        if (v.get() == val)
-        {
-            findit = it;
-            found = true;
-            break;
-        }
+        dwInternetStatus >>= 1;
+        slot++;
     }
-    if (found)
-        m_ActiveRequests.erase(findit);
+    return slot;
 }
 
-template<class T>
-bool WinHttpHandleContainer<T>::IsRegistered(T *val)
+void CallbackStats::Raised()
 {
-    bool found = false;
-    std::lock_guard<std::mutex> lck(m_ActiveRequestMtx);
-
-    for (auto it = m_ActiveRequests.begin(); it != m_ActiveRequests.end(); ++it)
-    {
-        auto v = (*it);
-        if (v.get() == val)
-        {
-            found = true;
-            break;
-        }
-    }
-    TRACE("%-35s:%-8d:%-16p found:%d\n", __func__, __LINE__, (void*)val, found);
+    int64_t depth = m_Depth.fetch_add(1, std::memory_order_relaxed) + 1;
+    int64_t max = m_MaxDepth.load(std::memory_order_relaxed);
 
-    return found;
+    while ((depth > max) && !m_MaxDepth.compare_exchange_weak(max, depth, std::memory_order_relaxed))
+        ;
 }
 
-template<class T>
-void WinHttpHandleContainer<T>::Register(std::shared_ptr<T> rqst)
+void CallbackStats::Discarded(DWORD dwInternetStatus)
 {
-    TRACE("%-35s:%-8d:%-16p\n", __func__, __LINE__, (void*)(rqst.get()));
-    std::lock_guard<std::mutex> lck(m_ActiveRequestMtx);
-    m_ActiveRequests.push_back(rqst);
+    m_Depth.fetch_sub(1, std::memory_order_relaxed);
+    m_Status[StatusSlot(dwInternetStatus)].m_Discarded.fetch_add(1, std::memory_order_relaxed);
 }
 
-WinHttpSessionImp::~WinHttpSessionImp()
+void CallbackStats::Dispatched(DWORD dwInternetStatus, std::chrono::steady_clock::duration wait,
+                               std::chrono::steady_clock::duration run)
 {
-    TRACE("%-35s:%-8d:%-16p sesion\n", __func__, __LINE__, (void*)this);
-    SetCallback(NULL, 0);
-    TRACE("%-35s:%-8d:%-16p\n", __func__, __LINE__, (void*)this);
+    Histograms &histograms = m_Status[StatusSlot(dwInternetStatus)];
+
+    m_Depth.fetch_sub(1, std::memory_order_relaxed);
+    histograms.m_Dispatched.fetch_add(1, std::memory_order_relaxed);
+    histograms.m_Wait[LatencyBucket(wait)].fetch_add(1, std::memory_order_relaxed);
+    histograms.m_Run[LatencyBucket(run)].fetch_add(1, std::memory_order_relaxed);
 }
 
-THREADRETURN ComContainer::AsyncThreadFunction(LPVOID lpThreadParameter)
+BOOL CallbackStats::Query(WINHTTP_CALLBACK_STATS *pStats)
 {
-    ComContainer *comContainer = static_cast<ComContainer *>(lpThreadParameter);
+    DWORD dwInternetStatus = pStats->dwInternetStatus;
 
-    while (true)
+    // a single status bit or 0
+    if (dwInternetStatus & (dwInternetStatus - 1))
+        return FALSE;
+
+    memset(pStats, 0, sizeof(*pStats));
+    pStats->dwInternetStatus = dwInternetStatus;
+
+    for (int slot = 0; slot < STATUS_SLOTS; slot++)
     {
-        {
-            std::unique_lock<std::mutex> getAsyncEventHndlMtx(comContainer->m_hAsyncEventMtx);
-            while (!comContainer->m_hAsyncEventCounter)
-                comContainer->m_hAsyncEvent.wait(getAsyncEventHndlMtx);
-            getAsyncEventHndlMtx.unlock();
+        if (dwInternetStatus && (slot != StatusSlot(dwInternetStatus)))
+            continue;
 
-            comContainer->m_hAsyncEventCounter--;
+        Histograms &histograms = m_Status[slot];
+        pStats->ullDispatched += histograms.m_Dispatched.load(std::memory_order_relaxed);
+        pStats->ullDiscarded += histograms.m_Discarded.load(std::memory_order_relaxed);
+        for (int i = 0; i < WINHTTP_CALLBACK_STATS_BUCKETS; i++)
+        {
+            pStats->ullQueueWaitUs[i] += histograms.m_Wait[i].load(std::memory_order_relaxed);
+            pStats->ullExecutionUs[i] += histograms.m_Run[i].load(std::memory_order_relaxed);
         }
+    }
 
-        int still_running = 1;
+    pStats->ullQueueDepth = static_cast<ULONGLONG>(MAX(static_cast<int64_t>(0), m_Depth.load(std::memory_order_relaxed)));
+    pStats->ullMaxQueueDepth = static_cast<ULONGLONG>(m_MaxDepth.load(std::memory_order_relaxed));
+    return TRUE;
+}
 
-        while (still_running && !comContainer->GetThreadClosing())
-        {
-            WinHttpRequestImp *request = NULL;
+void UserCallbackContainer::Dispatch(UserCallbackContext *ctx)
+{
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    void *statusInformation = NULL;
 
-            comContainer->QueryData(&still_running);
+    if (ctx->GetStatusInformationValid())
+        statusInformation = ctx->GetStatusInformation();
 
-            //TRACE("%-35s:%-8d:%-16p\n", __func__, __LINE__, (void*)request);
-            struct CURLMsg *m;
+    if (!ctx->GetRequestRef()->GetClosed() && ctx->GetCb()) {
+        TRACE_VERBOSE("%-35s:%-8d:%-16p ctx = %p cb = %p ctx->GetUserdata() = %p dwInternetStatus:0x%lx statusInformation=%p refcount:%lu\n",
+            __func__, __LINE__, (void*)ctx->GetRequest(), reinterpret_cast<void*>(ctx), reinterpret_cast<void*>(ctx->GetCb()),
+            ctx->GetUserdata(), ctx->GetInternetStatus(), statusInformation, ctx->GetRequestRef().use_count());
 
-            /* call curl_multi_perform or curl_multi_socket_action first, then loop
-               through and check if there are any transfers that have completed */
+        ctx->GetCb()(ctx->GetRequest(),
+            (DWORD_PTR)(ctx->GetUserdata()),
+            ctx->GetInternetStatus(),
+            statusInformation,
+            ctx->GetStatusInformationLength());
 
-            do {
-                int msgq = 0;
-                request = NULL;
-                std::shared_ptr<WinHttpRequestImp> srequest;
+        TRACE_VERBOSE("%-35s:%-8d:%-16p ctx = %p cb = %p ctx->GetUserdata() = %p dwInternetStatus:0x%lx statusInformation=%p refcount:%lu\n",
+            __func__, __LINE__, (void*)ctx->GetRequest(), reinterpret_cast<void*>(ctx), reinterpret_cast<void*>(ctx->GetCb()),
+            ctx->GetUserdata(), ctx->GetInternetStatus(), statusInformation, ctx->GetRequestRef().use_count());
+    }
+    ctx->GetRequestCompletionCb()(ctx->GetRequestRef(), ctx->GetInternetStatus());
 
-                comContainer->m_MultiMutex.lock();
-                m = curl_multi_info_read(comContainer->m_curlm, &msgq);
-                if (m)
-                    curl_easy_getinfo(m->easy_handle, CURLINFO_PRIVATE, &request);
-                if (request)
-                {
-                    srequest = request->shared_from_this();
-                }
-                comContainer->m_MultiMutex.unlock();
-
-                if (m && (m->msg == CURLMSG_DONE) && request && srequest) {
-                    WINHTTP_ASYNC_RESULT result = { 0, 0 };
-                    DWORD dwInternetStatus;
-
-                    TRACE("%-35s:%-8d:%-16p type:%s result:%d\n", __func__, __LINE__, (void*)request, request->GetType().c_str(), m->data.result);
-                    request->GetCompletionCode() = m->data.result;
-
-                    if (m->data.result == CURLE_OK)
-                    {
-                        if (request->HandleQueryDataNotifications(srequest, 0))
-                        {
-                            TRACE("%-35s:%-8d:%-16p GetQueryDataEvent().notify_all\n", __func__, __LINE__, (void*)request);
-                        }
-                        {
-                            std::lock_guard<std::mutex> lck(request->GetQueryDataEventMtx());
-                            request->GetQueryDataEventState() = true;
-                        }
-                        request->HandleQueryDataNotifications(srequest, 0);
-                    }
+    CallbackStats::Instance().Dispatched(ctx->GetInternetStatus(), started - ctx->GetQueued(),
+                                         std::chrono::steady_clock::now() - started);
 
-                    request->GetBodyStringMutex().lock();
-
-                    request->GetCompletionStatus() = true;
-
-                    if (m->data.result == CURLE_OK)
-                    {
-                        void *ptr = request->GetResponseString().data();
-                        size_t available = request->GetResponseString().size();
-                        size_t totalread = 0;
-                        request->ConsumeIncoming(srequest, ptr, available, totalread);
-                        if (totalread)
-                        {
-                            TRACE("%-35s:%-8d:%-16p consumed length:%lu\n", __func__, __LINE__, (void*)srequest.get(), totalread);
-                        }
-                        request->FlushIncoming(srequest);
-                    }
-                    else if (m->data.result == CURLE_OPERATION_TIMEDOUT)
-                    {
-                        result.dwError = ERROR_WINHTTP_TIMEOUT;
-                        dwInternetStatus = WINHTTP_CALLBACK_STATUS_REQUEST_ERROR;
-                        request->AsyncQueue(srequest, dwInternetStatus, 0, &result, sizeof(result), true);
-                        TRACE("%-35s:%-8d:%-16p request done type = %s CURLE_OPERATION_TIMEDOUT\n",
-                              __func__, __LINE__, (void*)request, request->GetType().c_str());
-                    }
-                    else
-                    {
-                        result.dwError = ERROR_WINHTTP_OPERATION_CANCELLED;
-                        dwInternetStatus = WINHTTP_CALLBACK_STATUS_REQUEST_ERROR;
-                        TRACE("%-35s:%-8d:%-16p unknown async request done m->data.result = %d\n",
-                              __func__, __LINE__, (void*)request, m->data.result);
-#ifdef _DEBUG
-                        assert(0);
-#endif
-                        request->AsyncQueue(srequest, dwInternetStatus, 0, &result, sizeof(result), true);
-                    }
+    WinHttpRequestImp *request = ctx->GetRequest();
+    request->GetPendingNotifications().fetch_sub(1, std::memory_order_seq_cst);
+    request->ResumeIfDrained(ctx->GetRequestRef(), false);
+    delete ctx;
+}
 
-                    request->GetBodyStringMutex().unlock();
+// for a context that will never be dispatched, keeps the queue depth and the request's flow control right
+void UserCallbackContainer::Discard(UserCallbackContext *ctx)
+{
+    TRACE("%-35s:%-8d:%-16p ctx = %p dwInternetStatus:0x%lx\n", __func__, __LINE__, (void*)ctx->GetRequest(),
+          reinterpret_cast<void*>(ctx), ctx->GetInternetStatus());
 
-                } else if (m && (m->msg != CURLMSG_DONE)) {
-                    TRACE("%-35s:%-8d:%-16p unknown async request done\n", __func__, __LINE__, (void*)request);
-                    DWORD dwInternetStatus;
-                    WINHTTP_ASYNC_RESULT result = { 0, 0 };
-                    result.dwError = ERROR_WINHTTP_OPERATION_CANCELLED;
-                    dwInternetStatus = WINHTTP_CALLBACK_STATUS_REQUEST_ERROR;
-#ifdef _DEBUG
-                    assert(0);
-#endif
-                    if (request)
-                        request->AsyncQueue(srequest, dwInternetStatus, 0, &result, sizeof(result), true);
-                }
+    CallbackStats::Instance().Discarded(ctx->GetInternetStatus());
+    ctx->GetRequest()->GetPendingNotifications().fetch_sub(1, std::memory_order_seq_cst);
+    delete ctx;
+}
 
-                if (request)
-                {
-                    comContainer->RemoveHandle(srequest, request->GetCurl(), true);
-                    TRACE("%-35s:%-8d:%-16p\n", __func__, __LINE__, (void*)request);
-                }
-            } while (m);
-        }
-        if (comContainer->GetThreadClosing())
+THREADRETURN UserCallbackWorker::UserCallbackThreadFunction(LPVOID lpThreadParameter)
+{
+    UserCallbackWorker *cbContainer = static_cast<UserCallbackWorker *>(lpThreadParameter);
+
+    while (true)
+    {
+        // read before looking at the queue, an enqueue after this point makes the wait return at once
+        uint32_t seen = cbContainer->m_Signal.load(std::memory_order_acquire);
+        size_t dispatched = 0;
+
+        if (cbContainer->GetClosing())
         {
-            TRACE("%s:%d exiting\n", __func__, __LINE__);
+            TRACE("%s", "exiting\n");
             break;
         }
+
+        // GetNext takes everything queued so far in one exchange, dispatch the batch lock-free
+        while (UserCallbackContext *ctx = cbContainer->GetNext())
+        {
+            UserCallbackContainer::Dispatch(ctx);
+            dispatched++;
+        }
+
+        if (!dispatched)
+            cbContainer->WaitForSignal(seen);
     }
 
 #if OPENSSL_VERSION_NUMBER >= 0x10000000L && OPENSSL_VERSION_NUMBER < 0x10100000L
@@ -874,73 +892,1423 @@ THREADRETURN ComContainer::AsyncThreadFunction(LPVOID lpThreadParameter)
 #elif OPENSSL_VERSION_NUMBER < 0x10000000L
     ERR_remove_state(0);
 #endif
+
     return 0;
 }
 
-int ComContainer::QueryData(int *still_running)
+// worker thread only
+UserCallbackContext* UserCallbackWorker::GetNext()
 {
-    if (!still_running)
-        return 0;
-
-    int rc = 0;
-    struct timeval timeout;
+    if (!m_Pending)
+    {
+        UserCallbackContext *ctx = m_Incoming.exchange(NULL, std::memory_order_acquire);
 
-    fd_set fdread;
-    fd_set fdwrite;
-    fd_set fdexcep;
-    int maxfd = -1;
+        // the list was built LIFO, restore submission order
+        while (ctx)
+        {
+            UserCallbackContext *next = ctx->GetQueueNext();
+            ctx->GetQueueNext() = m_Pending;
+            m_Pending = ctx;
+            ctx = next;
+        }
+    }
 
-    long curl_timeo = -1;
+    UserCallbackContext *ctx = m_Pending;
+    if (ctx)
+    {
+        m_Pending = ctx->GetQueueNext();
+        ctx->GetQueueNext() = NULL;
+    }
 
-    FD_ZERO(&fdread);
-    FD_ZERO(&fdwrite);
-    FD_ZERO(&fdexcep);
+    return ctx;
+}
+
+void UserCallbackWorker::Signal()
+{
+    // seq_cst pairs with the m_Sleeping store in WaitForSignal: either we see the worker parked,
+    // or it sees the new m_Signal value and does not park
+    m_Signal.fetch_add(1, std::memory_order_seq_cst);
+    if (!m_Sleeping.load(std::memory_order_seq_cst))
+        return;
+
+#ifdef __linux__
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&m_Signal), FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+    std::lock_guard<std::mutex> lck(m_SignalMtx);
+    m_SignalCv.notify_one();
+#endif
+}
+
+void UserCallbackWorker::WaitForSignal(uint32_t seen)
+{
+    m_Sleeping.store(true, std::memory_order_seq_cst);
+#ifdef __linux__
+    // returns immediately with EAGAIN when m_Signal already moved past seen
+    if (m_Signal.load(std::memory_order_seq_cst) == seen)
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&m_Signal), FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+#else
+    {
+        std::unique_lock<std::mutex> lck(m_SignalMtx);
+        while (m_Signal.load(std::memory_order_seq_cst) == seen)
+            m_SignalCv.wait(lck);
+    }
+#endif
+    m_Sleeping.store(false, std::memory_order_relaxed);
+}
+
+static thread_local int winhttp_inline_depth = 0;
+static thread_local ComContainer *winhttp_inline_engine = NULL;
+static thread_local UserCallbackContext *winhttp_inline_head = NULL;
+static thread_local UserCallbackContext *winhttp_inline_tail = NULL;
+
+InlineCallbackScope::InlineCallbackScope(ComContainer *engine)
+{
+    if (!winhttp_inline_depth++)
+        winhttp_inline_engine = engine;
+}
+
+InlineCallbackScope::~InlineCallbackScope()
+{
+    // still inside the scope while flushing, notifications raised by the callbacks join the list
+    if (winhttp_inline_depth == 1)
+    {
+        while (UserCallbackContext *ctx = winhttp_inline_head)
+        {
+            winhttp_inline_head = ctx->GetQueueNext();
+            if (!winhttp_inline_head)
+                winhttp_inline_tail = NULL;
+            ctx->GetQueueNext() = NULL;
+            UserCallbackContainer::Dispatch(ctx);
+        }
+        winhttp_inline_engine = NULL;
+    }
+    winhttp_inline_depth--;
+}
+
+bool InlineCallbackScope::Active(ComContainer *engine)
+{
+    return winhttp_inline_depth && engine && (winhttp_inline_engine == engine);
+}
+
+void InlineCallbackScope::Defer(UserCallbackContext *ctx)
+{
+    ctx->GetQueueNext() = NULL;
+    if (winhttp_inline_tail)
+        winhttp_inline_tail->GetQueueNext() = ctx;
+    else
+        winhttp_inline_head = ctx;
+    winhttp_inline_tail = ctx;
+}
+
+SinkWriter::SinkWriter()
+{
+    int count = MAX(1, winhttp_sink_threads);
+
+    for (int i = 0; i < count; i++)
+    {
+        THREAD_HANDLE thread;
+
+        if (CreateWinHttpThread(thread, SinkThreadFunction, this, WINHTTP_THREAD_SINK, i))
+            m_Threads.push_back(thread);
+    }
+
+    TRACE("%-35s:%-8d:%-16p threads:%lu\n", __func__, __LINE__, (void*)this, m_Threads.size());
+}
+
+BOOL SinkWriter::Queue(const std::shared_ptr<WinHttpRequestImp> &srequest)
+{
+    if (m_Threads.empty())
+        return FALSE;
+
+    {
+        std::lock_guard<std::mutex> lck(m_Mtx);
+        m_Jobs.push_back(srequest);
+    }
+    m_Cv.notify_one();
+    return TRUE;
+}
+
+THREADRETURN SinkWriter::SinkThreadFunction(LPVOID lpThreadParameter)
+{
+    SinkWriter *writer = static_cast<SinkWriter *>(lpThreadParameter);
+
+    while (true)
+    {
+        std::shared_ptr<WinHttpRequestImp> srequest;
+        {
+            std::unique_lock<std::mutex> lck(writer->m_Mtx);
+
+            writer->m_Cv.wait(lck, [writer] { return !writer->m_Jobs.empty(); });
+            srequest = std::move(writer->m_Jobs.front());
+            writer->m_Jobs.pop_front();
+        }
+
+        srequest->DrainSink(srequest);
+    }
+    return 0;
+}
+
+UserCallbackContainer::UserCallbackContainer()
+{
+    int count = winhttp_callback_threads;
+
+    if (count <= 0)
+        count = MAX(1, static_cast<int>(std::thread::hardware_concurrency()));
+
+    for (int i = 0; i < count; i++)
+    {
+        std::unique_ptr<UserCallbackWorker> worker(new UserCallbackWorker(i));
+
+        if (worker->IsRunning())
+            m_Workers.push_back(std::move(worker));
+    }
+
+    TRACE("%-35s:%-8d:%-16p workers:%d\n", __func__, __LINE__, (void*)this, count);
+}
+
+UserCallbackWorker &UserCallbackContainer::GetWorker(WinHttpRequestImp *request)
+{
+    if (m_Workers.size() == 1)
+        return *m_Workers.front();
+
+    // heap pointers share their low bits, mix them before picking a worker
+    uint64_t key = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(request)) * 0x9E3779B97F4A7C15ULL;
+    return *m_Workers[(key >> 32) % m_Workers.size()];
+}
+
+BOOL UserCallbackContainer::Queue(UserCallbackContext *ctx)
+{
+    if (!ctx)
+        return FALSE;
+
+    if (m_Workers.empty())
+    {
+        TRACE("%-35s:%-8d:%-16p no dispatcher thread\n", __func__, __LINE__, (void*)ctx->GetRequest());
+        Discard(ctx);
+        return FALSE;
+    }
+
+    return GetWorker(ctx->GetRequest()).Queue(ctx);
+}
+
+BOOL UserCallbackWorker::Queue(UserCallbackContext *ctx)
+{
+    if (!ctx)
+        return FALSE;
+
+    TRACE_VERBOSE("%-35s:%-8d:%-16p ctx = %p cb = %p userdata = %p dwInternetStatus = %p\n",
+        __func__, __LINE__, (void*)ctx->GetRequest(), reinterpret_cast<void*>(ctx), reinterpret_cast<void*>(ctx->GetCb()),
+        ctx->GetUserdata(), ctx->GetStatusInformation());
+
+    UserCallbackContext *head = m_Incoming.load(std::memory_order_relaxed);
+    do {
+        ctx->GetQueueNext() = head;
+    } while (!m_Incoming.compare_exchange_weak(head, ctx, std::memory_order_release, std::memory_order_relaxed));
+
+    Signal();
+    return TRUE;
+}
+
+// worker thread gone, release whatever was never dispatched
+void UserCallbackWorker::DrainQueue()
+{
+    while (UserCallbackContext *ctx = GetNext())
+        UserCallbackContainer::Discard(ctx);
+}
+
+void ComContainer::GlobalInit()
+{
+    static bool initialized = [] {
+        curl_global_init(CURL_GLOBAL_ALL);
+        thread_setup();
+        return true;
+    }();
+    (void)initialized;
+}
+
+struct ThreadStart
+{
+    LPTHREAD_START_ROUTINE m_Func;
+    LPVOID m_Param;
+    int m_Kind;
+    int m_Index;
+};
+
+// runs on the new thread, applies what can only be set from inside it
+static THREADRETURN ThreadTrampoline(THREADPARAM lpThreadParameter)
+{
+    std::unique_ptr<ThreadStart> start(static_cast<ThreadStart *>(lpThreadParameter));
+    ThreadPlacement &placement = winhttp_thread_placement[start->m_Kind];
+    std::string cpus;
+    char name[16];
+
+    snprintf(name, sizeof(name), "whttp-%s-%d", placement.m_Name, start->m_Index);
+    for (int cpu : placement.m_Cpus)
+        cpus += (cpus.empty() ? "" : ",") + std::to_string(cpu);
+
+#ifdef __linux__
+    pthread_setname_np(pthread_self(), name);
+
+    if (!placement.m_Cpus.empty())
+    {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        for (int cpu : placement.m_Cpus)
+            CPU_SET(cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+            TRACE("%-35s:%-8d:%-16p %s pthread_setaffinity_np() failed\n", __func__, __LINE__, (void*)start.get(), name);
+    }
+
+    // per-thread nice value
+    if (placement.m_HasPriority && (setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), placement.m_Priority) != 0))
+        TRACE("%-35s:%-8d:%-16p %s setpriority() failed: %d\n", __func__, __LINE__, (void*)start.get(), name, errno);
+#elif defined(__APPLE__)
+    pthread_setname_np(name);
+#endif
+
+    TRACE("%-35s:%-8d:%-16p name:%s cpus:%s priority:%s stack:%lu\n", __func__, __LINE__, (void*)start.get(), name,
+          cpus.empty() ? "any" : cpus.c_str(),
+          placement.m_HasPriority ? std::to_string(placement.m_Priority).c_str() : "default", winhttp_thread_stack_size);
+
+    return start->m_Func(start->m_Param);
+}
+
+BOOL CreateWinHttpThread(THREAD_HANDLE &thread, LPTHREAD_START_ROUTINE func, LPVOID param, int kind, int index)
+{
+#ifdef WIN32
+    DWORD thread_id;
+    thread = CREATETHREAD(func, param, &thread_id);
+    return thread != NULL;
+#else
+    ThreadStart *start = new ThreadStart;
+    pthread_attr_t attr;
+    BOOL ret = TRUE;
+
+    start->m_Func = func;
+    start->m_Param = param;
+    start->m_Kind = kind;
+    start->m_Index = index;
+
+    pthread_attr_init(&attr);
+    if (winhttp_thread_stack_size && (pthread_attr_setstacksize(&attr, winhttp_thread_stack_size) != 0))
+        TRACE("%-35s:%-8d:%-16p invalid stack size:%lu\n", __func__, __LINE__, (void*)start, winhttp_thread_stack_size);
+
+    if (pthread_create(&thread, &attr, ThreadTrampoline, start) != 0)
+    {
+        TRACE("%-35s:%-8d:%-16p pthread_create() failed: %d\n", __func__, __LINE__, (void*)start, errno);
+        delete start;
+        ret = FALSE;
+    }
+    pthread_attr_destroy(&attr);
+    return ret;
+#endif
+}
+
+CURL *ComContainer::AllocCURL()
+{
+    GlobalInit();
+    return curl_easy_init();
+}
+
+void ComContainer::FreeCURL(CURL *ptr)
+{
+    curl_easy_cleanup(ptr);
+}
+
+std::vector<ComContainer *> &ComContainer::GetShards()
+{
+    static std::vector<ComContainer *> *the_shards = [] {
+        std::vector<ComContainer *> *shards = new std::vector<ComContainer *>();
+        int count = winhttp_engine_shards;
+
+        if (count <= 0)
+            count = MAX(1, static_cast<int>(std::thread::hardware_concurrency()));
+
+        GlobalInit();
+
+        for (int i = 0; i < count; i++)
+            shards->push_back(new ComContainer(i));
+
+        TRACE("%-35s:%-8d:%-16p shards:%d policy:%d\n", __func__, __LINE__, (void*)shards, count, winhttp_engine_policy);
+        return shards;
+    }();
+    return *the_shards;
+}
+
+ComContainer &ComContainer::GetInstance()
+{
+    return *GetShards().front();
+}
+
+ComContainer &ComContainer::GetInstance(size_t hostHash, bool byHost)
+{
+    std::vector<ComContainer *> &shards = GetShards();
+
+    if (shards.size() == 1)
+        return *shards.front();
+
+    if (!byHost && (winhttp_engine_policy == WINHTTP_ENGINE_POLICY_LEAST_LOADED))
+    {
+        ComContainer *best = shards.front();
+
+        for (auto shard : shards)
+        {
+            if (shard->GetLoad() < best->GetLoad())
+                best = shard;
+        }
+        return *best;
+    }
+
+    return *shards[hostHash % shards.size()];
+}
+
+void ComContainer::ResumeTransfer(std::shared_ptr<WinHttpRequestImp> &srequest, int bitmask)
+{
+    EngineCommand *cmd = new EngineCommand;
+
+    cmd->m_Type = ENGINE_COMMAND_RESUME;
+    cmd->m_Request = srequest;
+    cmd->m_Bitmask = bitmask;
+    PostCommand(cmd);
+}
+
+// a closed request still waiting for a MAX_CONNS_PER_SERVER slot leaves the queue at once
+void ComContainer::CancelPending(std::shared_ptr<WinHttpRequestImp> &srequest)
+{
+    EngineCommand *cmd = new EngineCommand;
+
+    cmd->m_Type = ENGINE_COMMAND_CANCEL;
+    cmd->m_Request = srequest;
+    PostCommand(cmd);
+}
+
+void ComContainer::PostNotification(UserCallbackContext *ctx)
+{
+    EngineCommand *cmd = new EngineCommand;
+
+    cmd->m_Type = ENGINE_COMMAND_NOTIFY;
+    cmd->m_Context = ctx;
+    PostCommand(cmd);
+}
+
+BOOL ComContainer::AddHandle(std::shared_ptr<WinHttpRequestImp> &srequest)
+{
+    EngineCommand *cmd = new EngineCommand;
+
+    cmd->m_Type = ENGINE_COMMAND_ADD;
+    cmd->m_Request = srequest;
+    PostCommand(cmd);
+
+    return TRUE;
+}
+
+BOOL ComContainer::AddHandles(std::vector<std::shared_ptr<WinHttpRequestImp>> &requests)
+{
+    EngineCommand *first = NULL;
+    EngineCommand *last = NULL;
+
+    // chain newest first so the engine's LIFO reversal restores the batch order
+    for (auto &srequest : requests)
+    {
+        EngineCommand *cmd = new EngineCommand;
+
+        cmd->m_Type = ENGINE_COMMAND_ADD;
+        cmd->m_Request = srequest;
+        cmd->m_Next = first;
+        first = cmd;
+        if (!last)
+            last = cmd;
+    }
+
+    if (first)
+        PostCommands(first, last);
+
+    return TRUE;
+}
+
+void ComContainer::PostCommand(EngineCommand *cmd)
+{
+    cmd->m_Next = NULL;
+    PostCommands(cmd, cmd);
+}
+
+void ComContainer::PostCommands(EngineCommand *first, EngineCommand *last)
+{
+    EngineCommand *head = m_Commands.load(std::memory_order_relaxed);
+
+    do {
+        last->m_Next = head;
+    } while (!m_Commands.compare_exchange_weak(head, first, std::memory_order_seq_cst, std::memory_order_relaxed));
+
+    // only the poster that made the list non-empty needs to interrupt the engine
+    // whoever takes the commands of a detached engine disposes of them, the engine included
+    if (m_Detached)
+        DiscardCommands(m_Commands.exchange(NULL, std::memory_order_acquire));
+    else if (!head)
+        KickStart();
+}
+
+void ComContainer::DiscardCommands(EngineCommand *cmd)
+{
+    EngineCommand *ordered = NULL;
+
+    while (cmd)
+    {
+        EngineCommand *next = cmd->m_Next;
+        cmd->m_Next = ordered;
+        ordered = cmd;
+        cmd = next;
+    }
+
+    while (ordered)
+    {
+        cmd = ordered;
+        ordered = cmd->m_Next;
+
+        // nothing will run the inline delivery any more, hand it to the dispatcher workers
+        if (cmd->m_Context)
+            UserCallbackContainer::GetInstance().Queue(cmd->m_Context);
+        delete cmd;
+    }
+}
+
+void ComContainer::AddRef()
+{
+    // the shards are never deleted
+    if (!m_ExternalLoop)
+        return;
+
+    std::lock_guard<std::mutex> lck(m_LifetimeMtx);
+    m_Refs++;
+}
+
+void ComContainer::Release()
+{
+    if (!m_ExternalLoop)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lck(m_LifetimeMtx);
+        if (--m_Refs)
+            return;
+
+        // the host is inside ProcessSocket/ProcessTimeout, LeaveCall deletes it on the way out
+        if (m_Calls)
+        {
+            m_DeletePending = true;
+            return;
+        }
+    }
+    delete this;
+}
+
+void ComContainer::EnterCall()
+{
+    std::lock_guard<std::mutex> lck(m_LifetimeMtx);
+    m_Calls++;
+}
+
+// false when the engine was deleted
+bool ComContainer::LeaveCall()
+{
+    std::unique_lock<std::mutex> lck(m_LifetimeMtx);
+
+    // a detach requested from inside a call runs once the outermost one unwinds
+    while ((m_Calls == 1) && m_DetachPending)
+    {
+        m_DetachPending = false;
+        lck.unlock();
+        AbandonTransfers();
+        lck.lock();
+    }
+
+    if (--m_Calls || !m_DeletePending)
+        return true;
+
+    lck.unlock();
+    delete this;
+    return false;
+}
+
+// the session is closing, called with the engine held by its reference
+void ComContainer::Detach()
+{
+    EnterCall();
+    {
+        std::lock_guard<std::mutex> lck(m_LifetimeMtx);
+        m_DetachPending = true;
+    }
+    LeaveCall();
+}
+
+void ComContainer::AbandonTransfers()
+{
+    TRACE("%-35s:%-8d:%-16p transfers:%zu\n", __func__, __LINE__, (void*)this, m_Transfers.size());
+
+    m_Detached = true;
+    DiscardCommands(m_Commands.exchange(NULL, std::memory_order_acquire));
+
+    // may drop the last references to requests, and through them to the engine, which m_Calls defers
+    m_Admissions.clear();
+    while (!m_Transfers.empty())
+        RemoveHandle(m_Transfers.begin()->first, true);
+}
+
+// engine thread only
+void ComContainer::ProcessCommands()
+{
+    // seq_cst like the push and both sides of m_WakePending, a kick suppressed before DrainWakeup
+    // cleared the flag is ordered before this and its command is taken here
+    EngineCommand *cmd = m_Commands.exchange(NULL, std::memory_order_seq_cst);
+    EngineCommand *ordered = NULL;
+
+    // the list was built LIFO, restore submission order
+    while (cmd)
+    {
+        EngineCommand *next = cmd->m_Next;
+        cmd->m_Next = ordered;
+        ordered = cmd;
+        cmd = next;
+    }
+
+    while (ordered)
+    {
+        cmd = ordered;
+        ordered = cmd->m_Next;
+
+        if (cmd->m_Type == ENGINE_COMMAND_ADD)
+        {
+            AttachHandle(cmd->m_Request);
+        }
+        else if (cmd->m_Type == ENGINE_COMMAND_RESUME)
+        {
+            auto it = m_Transfers.find(cmd->m_Request->GetCurl());
+
+            // m_Bitmask names the directions to resume, every WinHttpWriteData posts one and most find the transfer running
+            if ((it != m_Transfers.end()) && (it->second.m_Request == cmd->m_Request) &&
+                (it->second.m_PauseBitmask & cmd->m_Bitmask))
+            {
+                int remaining = it->second.m_PauseBitmask & ~cmd->m_Bitmask;
+
+                TRACE_VERBOSE("%-35s:%-8d:%-16p resume:%d still paused:%d\n", __func__, __LINE__, (void*)cmd->m_Request.get(),
+                              cmd->m_Bitmask, remaining);
+
+                // before the call, curl may hand over buffered data and the callbacks pause again inside it
+                it->second.m_PauseBitmask = remaining;
+                curl_easy_pause(it->first, remaining);
+            }
+        }
+        else if (cmd->m_Type == ENGINE_COMMAND_NOTIFY)
+        {
+            // raised on an application thread, delivered in order with the engine's own notifications
+            InlineCallbackScope::Defer(cmd->m_Context);
+        }
+        else if (cmd->m_Type == ENGINE_COMMAND_CANCEL)
+        {
+            DropPending(cmd->m_Request);
+        }
+        delete cmd;
+    }
+}
+
+// engine thread only
+void ComContainer::AttachHandle(std::shared_ptr<WinHttpRequestImp> &srequest)
+{
+    CURLMcode mres;
+    CURL *handle = srequest->GetCurl();
+
+    // a request re-sent before its previous transfer was reaped
+    if (m_Transfers.find(handle) != m_Transfers.end())
+        RemoveHandle(handle, false);
+
+    if (!Admit(srequest))
+        return;
+
+    mres = curl_multi_add_handle(m_curlm, handle);
+    if (mres != CURLM_OK)
+    {
+        WINHTTP_ASYNC_RESULT result = { 0, 0 };
+
+        TRACE("curl_multi_add_handle() failed: %s\n", curl_multi_strerror(mres));
+        result.dwResult = API_SEND_REQUEST;
+        result.dwError = ERROR_WINHTTP_OPERATION_CANCELLED;
+        srequest->AsyncQueue(srequest, WINHTTP_CALLBACK_STATUS_REQUEST_ERROR, 0, &result, sizeof(result), true);
+        m_Load--;
+        if (srequest->GetHostConnectionLimit())
+            ReleaseAdmission(AdmissionKey(srequest->GetSessionSerial(), srequest->GetHostHash()));
+        return;
+    }
+
+    ActiveTransfer &transfer = m_Transfers[handle];
+    transfer.m_Request = srequest;
+    transfer.m_PauseBitmask = CURLPAUSE_CONT;
+    transfer.m_Started = std::chrono::steady_clock::now();
+    transfer.m_Admitted = srequest->GetHostConnectionLimit() != 0;
+
+    // map nodes do not move, the pin stays valid until RemoveHandle
+    srequest->SetTransferPin(&transfer);
+}
+
+// engine thread only, false when the request has to wait for a slot under its MAX_CONNS_PER_SERVER cap
+bool ComContainer::Admit(std::shared_ptr<WinHttpRequestImp> &srequest)
+{
+    DWORD limit = srequest->GetHostConnectionLimit();
+
+    if (!limit)
+        return true;
+
+    // counts transfers rather than connections, multiplexed HTTP/2 streams are held to the cap as well
+    HostAdmission &admission = m_Admissions[AdmissionKey(srequest->GetSessionSerial(), srequest->GetHostHash())];
+    if (admission.m_Active >= limit)
+    {
+        TRACE("%-35s:%-8d:%-16p shard:%d waiting, active:%lu limit:%lu\n", __func__, __LINE__, (void*)srequest.get(), m_Index,
+              admission.m_Active, limit);
+        admission.m_Pending.push_back(srequest);
+        return false;
+    }
+
+    admission.m_Active++;
+    return true;
+}
+
+// engine thread only, a transfer that is running or already gone is left alone
+void ComContainer::DropPending(std::shared_ptr<WinHttpRequestImp> &srequest)
+{
+    auto it = m_Admissions.find(AdmissionKey(srequest->GetSessionSerial(), srequest->GetHostHash()));
+
+    if (it == m_Admissions.end())
+        return;
+
+    std::deque<std::shared_ptr<WinHttpRequestImp>> &pending = it->second.m_Pending;
+    auto found = std::find(pending.begin(), pending.end(), srequest);
+
+    if (found == pending.end())
+        return;
+
+    TRACE("%-35s:%-8d:%-16p shard:%d closed while waiting\n", __func__, __LINE__, (void*)srequest.get(), m_Index);
+    pending.erase(found);
+    m_Load--;
+
+    if (!it->second.m_Active && pending.empty())
+        m_Admissions.erase(it);
+}
+
+// engine thread only, hands the freed slot to the next transfer waiting on the same session and host
+void ComContainer::ReleaseAdmission(const AdmissionKey &key)
+{
+    auto it = m_Admissions.find(key);
+
+    if (it == m_Admissions.end())
+        return;
+
+    if (it->second.m_Active)
+        it->second.m_Active--;
+
+    while (!it->second.m_Pending.empty())
+    {
+        std::shared_ptr<WinHttpRequestImp> next = std::move(it->second.m_Pending.front());
+        it->second.m_Pending.pop_front();
+
+        // closed while waiting, nobody is left to read it
+        if (next->GetClosing())
+        {
+            m_Load--;
+            continue;
+        }
+
+        // takes the slot, and releases it again through here if curl refuses the handle
+        AttachHandle(next);
+        return;
+    }
+
+    if (!it->second.m_Active)
+        m_Admissions.erase(it);
+}
+
+// engine thread only
+BOOL ComContainer::RemoveHandle(CURL *handle, bool clearPrivate)
+{
+    CURLMcode mres;
+
+    mres = curl_multi_remove_handle(m_curlm, handle);
+
+    if (clearPrivate)
+        curl_easy_getinfo(handle, CURLINFO_PRIVATE, NULL);
+
+    auto it = m_Transfers.find(handle);
+    if (it != m_Transfers.end())
+    {
+        std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - it->second.m_Started;
+
+        TRACE("%-35s:%-8d:%-16p shard:%d elapsed:%lldms\n", __func__, __LINE__, (void*)it->second.m_Request.get(), m_Index,
+              static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count()));
+
+        std::shared_ptr<WinHttpRequestImp> &request = it->second.m_Request;
+        bool admitted = it->second.m_Admitted;
+        AdmissionKey key(request->GetSessionSerial(), request->GetHostHash());
+
+        request->SetTransferPin(NULL);
+
+        // may drop the last reference to the request
+        m_Transfers.erase(it);
+        m_Load--;
+
+        if (admitted)
+            ReleaseAdmission(key);
+    }
+    if (mres != CURLM_OK)
+    {
+        TRACE("curl_multi_remove_handle() failed: %s\n", curl_multi_strerror(mres));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+void ComContainer::KickStart()
+{
+    if (m_WakePending.exchange(true))
+        return;
+
+#ifdef __linux__
+    uint64_t one = 1;
+    ssize_t rc = write(m_WakeWriteFd, &one, sizeof(one));
+#else
+    char one = 1;
+    ssize_t rc = write(m_WakeWriteFd, &one, sizeof(one));
+#endif
+    (void)rc;
+}
+
+void ComContainer::DrainWakeup()
+{
+    char buf[64];
+
+    // drain first, then clear. A kick landing in between is suppressed, but its command is already
+    // queued and the caller runs ProcessCommands next. Clearing first would let the read swallow the
+    // write of a kick that still left the flag set, and no kick would ever write again.
+    while (read(m_WakeReadFd, buf, sizeof(buf)) > 0)
+        ;
+    m_WakePending.store(false, std::memory_order_seq_cst);
+}
+
+ComContainer::ComContainer(int index, const WINHTTP_EVENT_LOOP_CALLBACKS *external):
+    m_Index(index), m_Load(0), m_Commands(NULL), m_WakePending(false)
+{
+    GlobalInit();
+    m_curlm = curl_multi_init();
+
+    if (external)
+    {
+        m_ExternalLoop = true;
+        m_External = *external;
+    }
+
+#ifdef __linux__
+    m_WakeReadFd = m_WakeWriteFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (!m_ExternalLoop)
+    {
+        m_epollfd = epoll_create1(EPOLL_CLOEXEC);
+        if (m_epollfd < 0)
+            TRACE("epoll_create1() failed: %d\n", errno);
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = m_WakeReadFd;
+        epoll_ctl(m_epollfd, EPOLL_CTL_ADD, m_WakeReadFd, &ev);
+
+        // steady_clock is CLOCK_MONOTONIC, deadlines can be handed to the timerfd as they are
+        m_TimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (m_TimerFd >= 0)
+        {
+            ev.data.fd = m_TimerFd;
+            epoll_ctl(m_epollfd, EPOLL_CTL_ADD, m_TimerFd, &ev);
+        }
+        else
+            TRACE("timerfd_create() failed: %d\n", errno);
+    }
+#else
+    int fds[2] = { -1, -1 };
+    if (pipe(fds) == 0)
+    {
+        fcntl(fds[0], F_SETFL, O_NONBLOCK);
+        fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    }
+    m_WakeReadFd = fds[0];
+    m_WakeWriteFd = fds[1];
+#endif
+    curl_multi_setopt(m_curlm, CURLMOPT_SOCKETFUNCTION, SocketCallback);
+    curl_multi_setopt(m_curlm, CURLMOPT_SOCKETDATA, this);
+    curl_multi_setopt(m_curlm, CURLMOPT_TIMERFUNCTION, TimerCallback);
+    curl_multi_setopt(m_curlm, CURLMOPT_TIMERDATA, this);
+
+    curl_multi_setopt(m_curlm, CURLMOPT_PIPELINING, winhttp_multiplex ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
+    if (winhttp_max_host_connections)
+        curl_multi_setopt(m_curlm, CURLMOPT_MAX_HOST_CONNECTIONS, winhttp_max_host_connections);
+    if (winhttp_max_total_connections)
+        curl_multi_setopt(m_curlm, CURLMOPT_MAX_TOTAL_CONNECTIONS, winhttp_max_total_connections);
+
+    if (m_ExternalLoop)
+    {
+        // commands posted from other threads show up as the wakeup descriptor becoming readable
+        TRACE("%-35s:%-8d:%-16p external loop wakefd:%d\n", __func__, __LINE__, (void*)this, m_WakeReadFd);
+        m_External.pfnSocket(m_External.pContext, m_WakeReadFd, WINHTTP_EVENT_LOOP_IN);
+        return;
+    }
+
+    m_HasThread = CreateWinHttpThread(m_hAsyncThread,
+        AsyncThreadFunction,       // thread function name
+        this, WINHTTP_THREAD_ENGINE, m_Index);          // argument to thread function
+    if (!m_HasThread)
+        TRACE("%-35s:%-8d:%-16p shard:%d no engine thread\n", __func__, __LINE__, (void*)this, m_Index);
+}
+
+ComContainer::~ComContainer()
+{
+    TRACE("%-35s:%-8d:%-16p shard:%d\n", __func__, __LINE__, (void*)this, m_Index);
+    m_closing = true;
+    if (m_ExternalLoop)
+    {
+        m_External.pfnSocket(m_External.pContext, m_WakeReadFd, WINHTTP_EVENT_LOOP_REMOVE);
+    }
+    else if (m_HasThread)
+    {
+        KickStart();
+        THREADJOIN(m_hAsyncThread);
+    }
+    TRACE("%-35s:%-8d:%-16p\n", __func__, __LINE__, (void*)this);
+
+    // nothing may be admitted anymore as the running transfers are removed
+    m_Admissions.clear();
+    while (!m_Transfers.empty())
+        RemoveHandle(m_Transfers.begin()->first, true);
+
+    curl_multi_cleanup(m_curlm);
+#ifdef __linux__
+    if (m_TimerFd >= 0)
+        close(m_TimerFd);
+    if (m_epollfd >= 0)
+        close(m_epollfd);
+#else
+    close(m_WakeWriteFd);
+#endif
+    close(m_WakeReadFd);
+
+    DiscardCommands(m_Commands.exchange(NULL));
+}
+
+template<class T>
+void WinHttpHandleContainer<T>::UnRegister(T *val)
+{
+    typedef std::shared_ptr<T> t_shared;
+    typename std::vector<t_shared>::iterator findit;
+    bool found = false;
+    std::lock_guard<std::mutex> lck(m_ActiveRequestMtx);
+
+    TRACE("%-35s:%-8d:%-16p\n", __func__, __LINE__, (void*)val);
+
+    for (auto it = m_ActiveRequests.begin(); it != m_ActiveRequests.end(); ++it)
+    {
+        auto v = (*it);
+        if (v.get() == val)
+        {
+            findit = it;
+            found = true;
+            break;
+        }
+    }
+    if (found)
+        m_ActiveRequests.erase(findit);
+}
+
+template<class T>
+bool WinHttpHandleContainer<T>::IsRegistered(T *val)
+{
+    bool found = false;
+    std::lock_guard<std::mutex> lck(m_ActiveRequestMtx);
+
+    for (auto it = m_ActiveRequests.begin(); it != m_ActiveRequests.end(); ++it)
+    {
+        auto v = (*it);
+        if (v.get() == val)
+        {
+            found = true;
+            break;
+        }
+    }
+    TRACE("%-35s:%-8d:%-16p found:%d\n", __func__, __LINE__, (void*)val, found);
+
+    return found;
+}
+
+template<class T>
+void WinHttpHandleContainer<T>::Register(std::shared_ptr<T> rqst)
+{
+    TRACE("%-35s:%-8d:%-16p\n", __func__, __LINE__, (void*)(rqst.get()));
+    std::lock_guard<std::mutex> lck(m_ActiveRequestMtx);
+    m_ActiveRequests.push_back(rqst);
+}
+
+WinHttpSessionImp::~WinHttpSessionImp()
+{
+    TRACE("%-35s:%-8d:%-16p sesion\n", __func__, __LINE__, (void*)this);
+    if (m_Engine)
+    {
+        // requests sent on it keep the engine alive, their transfers are dropped along with the session
+        m_Engine->Detach();
+        m_Engine->Release();
+    }
+    SetCallback(NULL, 0);
+    TRACE("%-35s:%-8d:%-16p\n", __func__, __LINE__, (void*)this);
+}
+
+BOOL WinHttpSessionImp::SetEventLoopCallbacks(WINHTTP_EVENT_LOOP_CALLBACKS *callbacks)
+{
+    if (!callbacks || !callbacks->pfnSocket || !callbacks->pfnTimer || m_Engine || !m_Async)
+        return FALSE;
+
+    m_Engine = new ComContainer(-1, callbacks);
+    return TRUE;
+}
+
+THREADRETURN ComContainer::AsyncThreadFunction(LPVOID lpThreadParameter)
+{
+    ComContainer *comContainer = static_cast<ComContainer *>(lpThreadParameter);
+
+    int still_running = 0;
+
+    // QueryData parks in the socket wait until I/O, the curl timer or a KickStart
+    while (!comContainer->GetThreadClosing())
+    {
+        InlineCallbackScope scope(comContainer);
+
+        comContainer->QueryData(&still_running);
+        comContainer->ReadCompletions();
+    }
+    TRACE("%s:%d exiting\n", __func__, __LINE__);
+
+#if OPENSSL_VERSION_NUMBER >= 0x10000000L && OPENSSL_VERSION_NUMBER < 0x10100000L
+    ERR_remove_thread_state(NULL);
+#elif OPENSSL_VERSION_NUMBER < 0x10000000L
+    ERR_remove_state(0);
+#endif
+    return 0;
+}
+
+// engine thread only, or the caller's loop in external mode
+void ComContainer::ReadCompletions()
+{
+    WinHttpRequestImp *request = NULL;
+
+    //TRACE("%-35s:%-8d:%-16p\n", __func__, __LINE__, (void*)request);
+    struct CURLMsg *m;
+
+    /* call curl_multi_perform or curl_multi_socket_action first, then loop
+       through and check if there are any transfers that have completed */
+
+    do {
+        int msgq = 0;
+        request = NULL;
+        std::shared_ptr<WinHttpRequestImp> srequest;
+
+        m = curl_multi_info_read(m_curlm, &msgq);
+        if (m)
+        {
+            auto it = m_Transfers.find(m->easy_handle);
+            if (it != m_Transfers.end())
+            {
+                srequest = it->second.m_Request;
+                request = srequest.get();
+            }
+        }
+
+        if (m && (m->msg == CURLMSG_DONE) && request && srequest) {
+            WINHTTP_ASYNC_RESULT result = { 0, 0 };
+            DWORD dwInternetStatus;
+
+            TRACE("%-35s:%-8d:%-16p type:%s result:%d\n", __func__, __LINE__, (void*)request, request->GetType().c_str(), m->data.result);
+            request->GetCompletionCode() = m->data.result;
+
+            if (m->data.result == CURLE_OK)
+                request->RecordReceivedBody();
+
+            if (m->data.result == CURLE_OK)
+            {
+                if (request->HandleQueryDataNotifications(srequest, 0))
+                {
+                    TRACE("%-35s:%-8d:%-16p GetQueryDataEvent().notify_all\n", __func__, __LINE__, (void*)request);
+                }
+                {
+                    std::lock_guard<std::mutex> lck(request->GetQueryDataEventMtx());
+                    request->GetQueryDataEventState() = true;
+                }
+                request->HandleQueryDataNotifications(srequest, 0);
+            }
+
+            request->GetBodyStringMutex().lock();
+
+            request->GetCompletionStatus() = true;
+
+            if (request->GetSinkFd() != -1)
+            {
+                request->FinishSink(srequest, m->data.result);
+            }
+            else if (m->data.result == CURLE_OK)
+            {
+                size_t totalread = request->ConsumeBuffered(srequest);
+                if (totalread)
+                {
+                    TRACE("%-35s:%-8d:%-16p consumed length:%lu\n", __func__, __LINE__, (void*)srequest.get(), totalread);
+                }
+
+                // a lent view still holds body bytes, WinHttpReleaseData completes the queued reads
+                if (!request->GetResponseBuffer().lent())
+                    request->FlushIncoming(srequest);
+            }
+            else if (m->data.result == CURLE_OPERATION_TIMEDOUT)
+            {
+                result.dwError = ERROR_WINHTTP_TIMEOUT;
+                dwInternetStatus = WINHTTP_CALLBACK_STATUS_REQUEST_ERROR;
+                request->AsyncQueue(srequest, dwInternetStatus, 0, &result, sizeof(result), true);
+                TRACE("%-35s:%-8d:%-16p request done type = %s CURLE_OPERATION_TIMEDOUT\n",
+                      __func__, __LINE__, (void*)request, request->GetType().c_str());
+            }
+            else
+            {
+                result.dwError = ERROR_WINHTTP_OPERATION_CANCELLED;
+                dwInternetStatus = WINHTTP_CALLBACK_STATUS_REQUEST_ERROR;
+                TRACE("%-35s:%-8d:%-16p unknown async request done m->data.result = %d\n",
+                      __func__, __LINE__, (void*)request, m->data.result);
+#ifdef _DEBUG
+                assert(0);
+#endif
+                request->AsyncQueue(srequest, dwInternetStatus, 0, &result, sizeof(result), true);
+            }
+
+            request->GetBodyStringMutex().unlock();
+
+        } else if (m && (m->msg != CURLMSG_DONE)) {
+            TRACE("%-35s:%-8d:%-16p unknown async request done\n", __func__, __LINE__, (void*)request);
+            DWORD dwInternetStatus;
+            WINHTTP_ASYNC_RESULT result = { 0, 0 };
+            result.dwError = ERROR_WINHTTP_OPERATION_CANCELLED;
+            dwInternetStatus = WINHTTP_CALLBACK_STATUS_REQUEST_ERROR;
+#ifdef _DEBUG
+            assert(0);
+#endif
+            if (request)
+                request->AsyncQueue(srequest, dwInternetStatus, 0, &result, sizeof(result), true);
+        }
+
+        if (request)
+        {
+            RemoveHandle(request->GetCurl(), true);
+            TRACE("%-35s:%-8d:%-16p\n", __func__, __LINE__, (void*)request);
+        }
+    } while (m);
+}
+
+BOOL ComContainer::ProcessSocket(int fd, DWORD dwEvents)
+{
+    BOOL ret;
+
+    // the callbacks below may close the session or the last request, keep the engine until they are done
+    EnterCall();
+    ret = HandleSocket(fd, dwEvents);
+    LeaveCall();
+    return ret;
+}
+
+BOOL ComContainer::ProcessTimeout()
+{
+    BOOL ret;
+
+    EnterCall();
+    ret = HandleTimeout();
+    LeaveCall();
+    return ret;
+}
+
+BOOL ComContainer::HandleSocket(int fd, DWORD dwEvents)
+{
+    InlineCallbackScope scope(this);
+    int evBitmask = 0;
+
+    if (fd == m_WakeReadFd)
+    {
+        DrainWakeup();
+        ProcessCommands();
+        ReadCompletions();
+        return TRUE;
+    }
+
+    if (dwEvents & WINHTTP_EVENT_LOOP_IN)
+        evBitmask |= CURL_CSELECT_IN;
+    if (dwEvents & WINHTTP_EVENT_LOOP_OUT)
+        evBitmask |= CURL_CSELECT_OUT;
+    if (dwEvents & WINHTTP_EVENT_LOOP_ERROR)
+        evBitmask |= CURL_CSELECT_ERR;
+
+    ProcessCommands();
+    SocketAction(fd, evBitmask);
+    ReadCompletions();
+    return TRUE;
+}
+
+BOOL ComContainer::HandleTimeout()
+{
+    InlineCallbackScope scope(this);
+
+    ProcessCommands();
+    SocketAction(CURL_SOCKET_TIMEOUT, 0);
+    ReadCompletions();
+    return TRUE;
+}
+
+int ComContainer::SocketCallback(CURL *easy, curl_socket_t s, int what, void *userp, void *socketp)
+{
+    ComContainer *comContainer = static_cast<ComContainer *>(userp);
+
+    TRACE_VERBOSE("%-35s:%-8d:%-16p socket:%d what:%d\n", __func__, __LINE__, (void*)easy, (int)s, what);
+    if (comContainer->m_ExternalLoop)
+    {
+        DWORD dwEvents = 0;
+
+        if (what == CURL_POLL_REMOVE)
+            dwEvents = WINHTTP_EVENT_LOOP_REMOVE;
+        if (what & CURL_POLL_IN)
+            dwEvents |= WINHTTP_EVENT_LOOP_IN;
+        if (what & CURL_POLL_OUT)
+            dwEvents |= WINHTTP_EVENT_LOOP_OUT;
+        comContainer->m_External.pfnSocket(comContainer->m_External.pContext, s, dwEvents);
+        return 0;
+    }
+#ifdef __linux__
+    if (what == CURL_POLL_REMOVE)
+    {
+        epoll_ctl(comContainer->m_epollfd, EPOLL_CTL_DEL, s, NULL);
+        return 0;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.data.fd = s;
+    if (what & CURL_POLL_IN)
+        ev.events |= EPOLLIN;
+    if (what & CURL_POLL_OUT)
+        ev.events |= EPOLLOUT;
+
+    // socketp is only used as a marker telling whether the socket is already in the epoll set
+    if (socketp)
+    {
+        if (epoll_ctl(comContainer->m_epollfd, EPOLL_CTL_MOD, s, &ev) == 0)
+            return 0;
+    }
+    if ((epoll_ctl(comContainer->m_epollfd, EPOLL_CTL_ADD, s, &ev) != 0) && (errno == EEXIST))
+        epoll_ctl(comContainer->m_epollfd, EPOLL_CTL_MOD, s, &ev);
+    curl_multi_assign(comContainer->m_curlm, s, comContainer);
+#else
+    if (what == CURL_POLL_REMOVE)
+        comContainer->m_Sockets.erase(s);
+    else
+        comContainer->m_Sockets[s] = what;
+#endif
+    return 0;
+}
+
+int ComContainer::TimerCallback(CURLM *, long timeout_ms, void *userp)
+{
+    ComContainer *comContainer = static_cast<ComContainer *>(userp);
+
+    if (comContainer->m_ExternalLoop)
+        comContainer->m_External.pfnTimer(comContainer->m_External.pContext, timeout_ms);
+
+    if (timeout_ms < 0)
+    {
+        comContainer->m_TimerArmed = false;
+        comContainer->ArmTimer();
+        return 0;
+    }
+
+    comContainer->m_TimerDeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    comContainer->m_TimerArmed = true;
+    comContainer->ArmTimer();
+    return 0;
+}
+
+void ComContainer::ArmTimer()
+{
+#ifdef __linux__
+    if (m_TimerFd < 0)
+        return;
 
-    /* set a suitable timeout to play around with */
-    timeout.tv_sec = 1;
-    timeout.tv_usec = 0;
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
 
-    m_MultiMutex.lock();
-    curl_multi_timeout(m_curlm, &curl_timeo);
-    m_MultiMutex.unlock();
-    if (curl_timeo < 0)
-        /* no set timeout, use a default */
-        curl_timeo = 10000;
+    if (m_TimerArmed)
+    {
+        long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(m_TimerDeadline.time_since_epoch()).count();
 
-    if (curl_timeo > 0) {
-        timeout.tv_sec = curl_timeo / 1000;
-        if (timeout.tv_sec > 1)
-            timeout.tv_sec = 1;
-        else
-            timeout.tv_usec = (curl_timeo % 1000) * 1000;
+        // an all-zero it_value would disarm the timer, a deadline already passed fires at once
+        if (ns <= 0)
+            ns = 1;
+        spec.it_value.tv_sec = static_cast<time_t>(ns / 1000000000LL);
+        spec.it_value.tv_nsec = static_cast<long>(ns % 1000000000LL);
+    }
+
+    if (timerfd_settime(m_TimerFd, TFD_TIMER_ABSTIME, &spec, NULL) != 0)
+        TRACE("timerfd_settime() failed: %d\n", errno);
+#endif
+}
+
+long ComContainer::GetWaitTimeoutMs()
+{
+    /* nothing scheduled, sleep until a socket or KickStart wakes us up */
+    if (!m_TimerArmed)
+        return -1;
+
+#ifdef __linux__
+    /* the timerfd wakes the wait at the exact deadline */
+    if (m_TimerFd >= 0)
+        return -1;
+#endif
+
+    std::chrono::steady_clock::duration left = m_TimerDeadline - std::chrono::steady_clock::now();
+    if (left <= std::chrono::steady_clock::duration::zero())
+        return 0;
+
+    /* round up, waking before the deadline would only spin until it passes */
+    long ms = static_cast<long>(std::chrono::duration_cast<std::chrono::milliseconds>(left).count());
+    if (std::chrono::milliseconds(ms) < left)
+        ms++;
+    return ms;
+}
+
+void ComContainer::SocketAction(curl_socket_t s, int evBitmask)
+{
+    CURLMcode mres;
+
+    if (s == CURL_SOCKET_TIMEOUT)
+        m_TimerArmed = false;
+
+    mres = curl_multi_socket_action(m_curlm, s, evBitmask, &m_RunningHandles);
+    if (mres != CURLM_OK)
+        TRACE("curl_multi_socket_action() failed: %s\n", curl_multi_strerror(mres));
+}
+
+int ComContainer::QueryData(int *still_running)
+{
+    if (!still_running)
+        return 0;
+
+    int rc;
+
+    ProcessCommands();
+
+    long timeout = GetWaitTimeoutMs();
+
+#ifdef __linux__
+    struct epoll_event events[WINHTTP_EPOLL_MAX_EVENTS];
+
+    rc = epoll_wait(m_epollfd, events, WINHTTP_EPOLL_MAX_EVENTS, static_cast<int>(timeout));
+    if ((rc < 0) && (errno == EINTR))
+        rc = 0;
+
+    for (int i = 0; i < rc; i++)
+    {
+        int evBitmask = 0;
+
+        if (events[i].data.fd == m_WakeReadFd)
+        {
+            DrainWakeup();
+            ProcessCommands();
+            continue;
+        }
+
+        if (events[i].data.fd == m_TimerFd)
+        {
+            uint64_t expirations;
+            ssize_t rd = read(m_TimerFd, &expirations, sizeof(expirations));
+            (void)rd;
+            continue;
+        }
+
+        if (events[i].events & EPOLLIN)
+            evBitmask |= CURL_CSELECT_IN;
+        if (events[i].events & EPOLLOUT)
+            evBitmask |= CURL_CSELECT_OUT;
+        if (events[i].events & (EPOLLERR | EPOLLHUP))
+            evBitmask |= CURL_CSELECT_ERR;
+
+        SocketAction(events[i].data.fd, evBitmask);
     }
+#else
+    std::vector<struct pollfd> fds;
+    struct pollfd wake;
 
-    /* get file descriptors from the transfers */
-    m_MultiMutex.lock();
-    rc = curl_multi_fdset(m_curlm, &fdread, &fdwrite, &fdexcep, &maxfd);
-    m_MultiMutex.unlock();
+    wake.fd = m_WakeReadFd;
+    wake.events = POLLIN;
+    wake.revents = 0;
+    fds.push_back(wake);
 
-    if ((maxfd == -1) || (rc != CURLM_OK)) {
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    for (auto &it : m_Sockets)
+    {
+        struct pollfd pfd;
+
+        pfd.fd = it.first;
+        pfd.events = 0;
+        pfd.revents = 0;
+        if (it.second & CURL_POLL_IN)
+            pfd.events |= POLLIN;
+        if (it.second & CURL_POLL_OUT)
+            pfd.events |= POLLOUT;
+        fds.push_back(pfd);
     }
-    else
-        rc = select(maxfd + 1, &fdread, &fdwrite, &fdexcep, &timeout);
 
-    switch (rc) {
-    case -1:
-        /* select error */
+    rc = poll(fds.data(), fds.size(), static_cast<int>(timeout));
+    if ((rc < 0) && (errno == EINTR))
+        rc = 0;
+
+    if ((rc > 0) && fds[0].revents)
+    {
+        DrainWakeup();
+        ProcessCommands();
+    }
+
+    for (size_t i = 1; (rc > 0) && (i < fds.size()); i++)
+    {
+        int evBitmask = 0;
+
+        if (!fds[i].revents)
+            continue;
+        if (fds[i].revents & POLLIN)
+            evBitmask |= CURL_CSELECT_IN;
+        if (fds[i].revents & POLLOUT)
+            evBitmask |= CURL_CSELECT_OUT;
+        if (fds[i].revents & (POLLERR | POLLHUP))
+            evBitmask |= CURL_CSELECT_ERR;
+
+        SocketAction(fds[i].fd, evBitmask);
+    }
+#endif
+
+    if (rc < 0)
+    {
+        /* wait error */
         *still_running = 0;
-        TRACE("%s\n", "select() returns error, this is badness\n");
-        break;
-    case 0:
-    default:
-        /* timeout or readable/writable sockets */
-        m_MultiMutex.lock();
-        curl_multi_perform(m_curlm, still_running);
-        m_MultiMutex.unlock();
-        break;
+        TRACE("%s\n", "waiting for socket events returns error, this is badness\n");
+        return rc;
     }
 
+    /* fire the libcurl timer if it expired while we were waiting, a new handle arms it with 0 */
+    if (m_TimerArmed && (std::chrono::steady_clock::now() >= m_TimerDeadline))
+        SocketAction(CURL_SOCKET_TIMEOUT, 0);
+
+    *still_running = m_RunningHandles;
+
     return rc;
 }
 
@@ -1054,12 +2422,32 @@ void WinHttpRequestImp::HandleReceiveNotifications(std::shared_ptr<WinHttpReques
     }
 }
 
+// curl callbacks, the engine keeps the request alive for the whole transfer so its reference is borrowed
+// without touching the refcount. Only the synchronous paths, which run curl on the caller's or the upload
+// thread, take a reference of their own.
+std::shared_ptr<WinHttpRequestImp> &WinHttpRequestImp::PinnedRef(std::shared_ptr<WinHttpRequestImp> &fallback)
+{
+    if (m_TransferPin)
+        return m_TransferPin->m_Request;
+
+    fallback = shared_from_this();
+    return fallback;
+}
+
+// engine thread only, from a curl callback about to return a PAUSE code
+void WinHttpRequestImp::NotePaused(int bitmask)
+{
+    if (m_TransferPin)
+        m_TransferPin->m_PauseBitmask |= bitmask;
+}
+
 size_t WinHttpRequestImp::WriteHeaderFunction(void *ptr, size_t size, size_t nmemb, void* rqst) {
     WinHttpRequestImp *request = static_cast<WinHttpRequestImp *>(rqst);
     if (!request)
         return 0;
 
-    std::shared_ptr<WinHttpRequestImp> srequest = request->shared_from_this();
+    std::shared_ptr<WinHttpRequestImp> fallback;
+    std::shared_ptr<WinHttpRequestImp> &srequest = request->PinnedRef(fallback);
     if (!srequest)
         return size * nmemb;
     bool EofHeaders = false;
@@ -1112,111 +2500,529 @@ size_t WinHttpRequestImp::WriteHeaderFunction(void *ptr, size_t size, size_t nme
         }
 
     }
-    return size * nmemb;
-}
+    return size * nmemb;
+}
+
+// draining selects the low watermark (half of the high one) used to decide about resuming
+bool WinHttpRequestImp::FlowControlExceeded(bool draining)
+{
+    int shift = draining ? 1 : 0;
+
+    if (winhttp_max_pending_notifications &&
+        (m_PendingNotifications.load(std::memory_order_seq_cst) >= (winhttp_max_pending_notifications >> shift)))
+        return true;
+
+    size_t limit = m_ResponseBufferLimit;
+
+    // a sink's buffer only holds what its writer hasn't caught up with, it is never left unbounded
+    if (!limit && (m_SinkFd != -1))
+        limit = WINHTTP_SINK_BUFFER_LIMIT;
+
+    if (limit && (m_ResponseBuffer.size() >= (limit >> shift)))
+        return true;
+
+    return false;
+}
+
+// engine thread with GetBodyStringMutex held, true when WriteBodyFunction has to return CURL_WRITEFUNC_PAUSE
+bool WinHttpRequestImp::PauseForFlowControl()
+{
+    if (!GetAsync() || !GetEngine() || GetClosing() || !FlowControlExceeded(false))
+        return false;
+
+    // seq_cst store then re-check, pairs with the decrement then load in Dispatch
+    m_WritePaused.store(true, std::memory_order_seq_cst);
+    if (FlowControlExceeded(true))
+    {
+        TRACE("%-35s:%-8d:%-16p paused pending:%ld buffered:%lu\n", __func__, __LINE__, (void*)this,
+              m_PendingNotifications.load(), m_ResponseBuffer.size());
+        return true;
+    }
+
+    // drained meanwhile, if a resume was already posted it finds the transfer running, which is harmless
+    m_WritePaused.store(false, std::memory_order_seq_cst);
+    return false;
+}
+
+void WinHttpRequestImp::ResumeIfDrained(std::shared_ptr<WinHttpRequestImp> &srequest, bool force)
+{
+    if (!m_WritePaused.load(std::memory_order_seq_cst))
+        return;
+
+    {
+        std::lock_guard<std::mutex> lck(GetBodyStringMutex());
+
+        if (!force && FlowControlExceeded(true))
+            return;
+        if (!m_WritePaused.exchange(false))
+            return;
+    }
+
+    TRACE("%-35s:%-8d:%-16p resumed pending:%ld\n", __func__, __LINE__, (void*)this, m_PendingNotifications.load());
+    if (GetEngine())
+        GetEngine()->ResumeTransfer(srequest, CURLPAUSE_RECV);
+}
+
+// nobody reads or writes the request any more, a transfer paused in either direction would never finish
+void WinHttpRequestImp::ResumeAll(std::shared_ptr<WinHttpRequestImp> &srequest)
+{
+    {
+        std::lock_guard<std::mutex> lck(GetBodyStringMutex());
+        m_WritePaused = false;
+    }
+
+    if (GetEngine())
+        GetEngine()->ResumeTransfer(srequest, CURLPAUSE_ALL);
+}
+
+size_t WinHttpRequestImp::WriteBodyFunction(void *ptr, size_t size, size_t nmemb, void* rqst) {
+    size_t read = 0;
+    WinHttpRequestImp *request = static_cast<WinHttpRequestImp *>(rqst);
+    if (!request)
+        return 0;
+
+    std::shared_ptr<WinHttpRequestImp> fallback;
+    std::shared_ptr<WinHttpRequestImp> &srequest = request->PinnedRef(fallback);
+    if (!srequest)
+        return 0;
+
+    // nothing is announced, a short count makes curl fail the transfer with CURLE_WRITE_ERROR
+    if (request->GetSinkFd() != -1)
+    {
+        if (request->GetAsync())
+        {
+            std::lock_guard<std::mutex> lck(request->GetBodyStringMutex());
+            return request->QueueToSink(srequest, ptr, size * nmemb);
+        }
+
+        int error;
+        if (request->WriteToSink(ptr, size * nmemb, error))
+            return size * nmemb;
+
+        request->m_SinkError = error;
+        return 0;
+    }
+
+    {
+        std::lock_guard<std::mutex> lck(request->GetBodyStringMutex());
+        size_t totalread = request->ConsumeBuffered(srequest);
+
+        if (totalread)
+            TRACE("%-35s:%-8d:%-16p consumed length:%lu\n", __func__, __LINE__, (void*)srequest.get(), totalread);
+    }
+
+    size_t available = size * nmemb;
+    {
+        std::lock_guard<std::mutex> lck(request->GetBodyStringMutex());
+        void *buf = ptr;
+
+        // nothing consumes this chunk right away and the app is behind, libcurl re-delivers it on resume
+        if (request->GetOutstandingReads().empty() && request->PauseForFlowControl())
+        {
+            request->NotePaused(CURLPAUSE_RECV);
+            return CURL_WRITEFUNC_PAUSE;
+        }
+
+        request->ConsumeIncoming(srequest, buf, available, read);
+
+        if (available)
+        {
+            request->GetResponseBuffer().append(buf, available);
+            read += available;
+        }
+    }
+
+    if (request->GetAsync()) {
+        if (available && request->HandleQueryDataNotifications(srequest, available))
+            TRACE("%-35s:%-8d:%-16p GetQueryDataEvent().notify_all\n", __func__, __LINE__, (void*)request);
+    }
+
+    return read;
+}
+
+void WinHttpRequestImp::ConsumeIncoming(std::shared_ptr<WinHttpRequestImp> &srequest, void* &ptr, size_t &available, size_t &read)
+{
+    while (available)
+    {
+        BufferRequest buf = GetBufferRequest(srequest->GetOutstandingReads());
+        if (!buf.m_Length)
+            break;
+
+        size_t len = MIN(buf.m_Length, available);
+
+        if (len)
+        {
+            TRACE("%-35s:%-8d:%-16p reading length:%lu written:%lu %p %ld\n",
+                __func__, __LINE__, (void*)srequest.get(), len, read, buf.m_Buffer, buf.m_Length);
+            memcpy(static_cast<char*>(buf.m_Buffer), ptr, len);
+        }
+
+        ptr = static_cast<char*>(ptr) + len;
+        available -= len;
+
+        if (len)
+        {
+            LPVOID StatusInformation = buf.m_Buffer;
+
+            TRACE("%-35s:%-8d:%-16p WINHTTP_CALLBACK_STATUS_READ_COMPLETE lpBuffer: %p length:%lu\n", __func__, __LINE__, (void*)srequest.get(), buf.m_Buffer, len);
+            srequest->AsyncQueue(srequest, WINHTTP_CALLBACK_STATUS_READ_COMPLETE, len, StatusInformation, sizeof(StatusInformation), false);
+        }
+
+        read += len;
+    }
+}
+
+// GetBodyStringMutex held, hands buffered body bytes to reads queued by WinHttpReadData
+size_t WinHttpRequestImp::ConsumeBuffered(std::shared_ptr<WinHttpRequestImp> &srequest)
+{
+    size_t total = 0;
+
+    if (m_ResponseBuffer.lent())
+        return 0;
+
+    while (!m_ResponseBuffer.empty() && !GetOutstandingReads().empty())
+    {
+        const void *front;
+        size_t available = m_ResponseBuffer.peek(&front);
+        void *ptr = const_cast<void *>(front);
+        size_t read = 0;
+
+        ConsumeIncoming(srequest, ptr, available, read);
+        m_ResponseBuffer.consume(read);
+        total += read;
+    }
+    return total;
+}
+
+void WinHttpRequestImp::FlushIncoming(std::shared_ptr<WinHttpRequestImp> &srequest)
+{
+    while (1)
+    {
+        BufferRequest buf = GetBufferRequest(srequest->GetOutstandingReads());
+        if (!buf.m_Length)
+            break;
+
+        LPVOID StatusInformation = buf.m_Buffer;
+
+        TRACE("%-35s:%-8d:%-16p WINHTTP_CALLBACK_STATUS_READ_COMPLETE lpBuffer: %p length:%d\n", __func__, __LINE__, (void*)srequest.get(), buf.m_Buffer, 0);
+        srequest->AsyncQueue(srequest, WINHTTP_CALLBACK_STATUS_READ_COMPLETE, 0, StatusInformation, sizeof(StatusInformation), false);
+    }
+}
+
+void WinHttpRequestImp::RecordReceivedBody()
+{
+    curl_off_t bodySize = 0;
+
+    if (!m_ReceiveBufferSizer)
+        return;
+
+    if (curl_easy_getinfo(m_curl, CURLINFO_SIZE_DOWNLOAD_T, &bodySize) == CURLE_OK)
+        m_ReceiveBufferSizer->Record(static_cast<uint64_t>(bodySize));
+}
+
+void ReceiveBufferSizer::Record(uint64_t bodySize)
+{
+    uint64_t average = m_AverageBody.load(std::memory_order_relaxed);
+    uint64_t next;
+
+    // moving average weighted 1/4 towards the latest body, the first one is taken as is
+    do
+    {
+        next = average ? (average - (average >> 2) + (bodySize >> 2)) : bodySize;
+    } while (!m_AverageBody.compare_exchange_weak(average, next, std::memory_order_relaxed));
+}
+
+long ReceiveBufferSizer::Pick(size_t responseBufferLimit) const
+{
+    // about eight write callbacks for an average body, a power of two between curl's default and maximum
+    uint64_t target = m_AverageBody.load(std::memory_order_relaxed) / 8;
+    long size = WINHTTP_CURL_MAX_WRITE_SIZE;
+
+    while ((static_cast<uint64_t>(size) < target) && (size < CURL_MAX_READ_SIZE))
+        size <<= 1;
+
+    size = MIN(size, static_cast<long>(CURL_MAX_READ_SIZE));
+
+    // each pause under the response buffer cap can overshoot it by one buffer
+    if (responseBufferLimit)
+        size = MIN(size, MAX(static_cast<long>(responseBufferLimit), static_cast<long>(WINHTTP_CURL_MAX_WRITE_SIZE)));
+
+    return size;
+}
+
+void ChunkBuffer::Recycle(std::unique_ptr<Block> block)
+{
+    if (m_Spare.size() < MAX_SPARE_BLOCKS)
+    {
+        block->m_Begin = block->m_End = 0;
+        m_Spare.push_back(std::move(block));
+    }
+}
+
+void ChunkBuffer::append(const void *data, size_t len)
+{
+    const BYTE *src = static_cast<const BYTE *>(data);
+
+    while (len)
+    {
+        if (m_Blocks.empty() || (m_Blocks.back()->m_End == BLOCK_SIZE))
+        {
+            if (m_Spare.empty())
+                m_Blocks.emplace_back(new Block);
+            else
+            {
+                m_Blocks.push_back(std::move(m_Spare.back()));
+                m_Spare.pop_back();
+            }
+        }
+
+        Block &block = *m_Blocks.back();
+        size_t copy = MIN(len, BLOCK_SIZE - block.m_End);
+
+        memcpy(block.m_Data + block.m_End, src, copy);
+        block.m_End += copy;
+        m_Size += copy;
+        src += copy;
+        len -= copy;
+    }
+}
+
+size_t ChunkBuffer::read(void *dest, size_t len)
+{
+    BYTE *dst = static_cast<BYTE *>(dest);
+    size_t total = 0;
+
+    while (len && m_Size)
+    {
+        const void *front;
+        size_t copy = MIN(len, peek(&front));
+
+        memcpy(dst, front, copy);
+        consume(copy);
+        dst += copy;
+        len -= copy;
+        total += copy;
+    }
+    return total;
+}
+
+size_t ChunkBuffer::peek(const void **data) const
+{
+    if (m_Blocks.empty())
+    {
+        *data = NULL;
+        return 0;
+    }
 
-size_t WinHttpRequestImp::WriteBodyFunction(void *ptr, size_t size, size_t nmemb, void* rqst) {
-    size_t read = 0;
-    WinHttpRequestImp *request = static_cast<WinHttpRequestImp *>(rqst);
-    if (!request)
-        return 0;
+    const Block &block = *m_Blocks.front();
+    *data = block.m_Data + block.m_Begin;
+    return block.m_End - block.m_Begin;
+}
 
-    std::shared_ptr<WinHttpRequestImp> srequest = request->shared_from_this();
-    if (!srequest)
-        return 0;
+void ChunkBuffer::consume(size_t len)
+{
+    len = MIN(len, m_Size);
+    m_Size -= len;
 
+    while (len)
     {
-        std::lock_guard<std::mutex> lck(request->GetBodyStringMutex());
-        void *buf = request->GetResponseString().data();
-        size_t available = request->GetResponseString().size();
-        size_t totalread = 0;
+        Block &block = *m_Blocks.front();
+        size_t step = MIN(len, block.m_End - block.m_Begin);
 
-        request->ConsumeIncoming(srequest, buf, available, totalread);
-        if (totalread)
+        block.m_Begin += step;
+        len -= step;
+
+        if (block.m_Begin == block.m_End)
         {
-            TRACE("%-35s:%-8d:%-16p consumed length:%lu\n", __func__, __LINE__, (void*)srequest.get(), totalread);
-            request->GetReadLength() += totalread;
-            request->GetReadData().erase(request->GetReadData().begin(), request->GetReadData().begin() + totalread);
-            request->GetReadData().shrink_to_fit();
+            Recycle(std::move(m_Blocks.front()));
+            m_Blocks.pop_front();
         }
     }
+}
 
-    size_t available = size * nmemb;
+void ChunkBuffer::clear()
+{
+    while (!m_Blocks.empty())
     {
-        std::lock_guard<std::mutex> lck(request->GetBodyStringMutex());
-        void *buf = ptr;
+        Recycle(std::move(m_Blocks.front()));
+        m_Blocks.pop_front();
+    }
+    m_Size = 0;
+    m_Lent = false;
+    m_LentLength = 0;
+}
 
-        request->ConsumeIncoming(srequest, buf, available, read);
+size_t ChunkBuffer::borrow(const void **data)
+{
+    // appends only write past the end of the front block and never move it
+    m_LentLength = peek(data);
+    m_Lent = (m_LentLength != 0);
+    return m_LentLength;
+}
 
-        if (available)
+bool ChunkBuffer::release(size_t len)
+{
+    if (!m_Lent || (len > m_LentLength))
+        return false;
+
+    m_Lent = false;
+    m_LentLength = 0;
+    consume(len);
+    return true;
+}
+
+void WinHttpRequestImp::SetSink(int fd, bool owned)
+{
+    if (m_SinkOwned && (m_SinkFd != -1))
+        close(m_SinkFd);
+
+    m_SinkFd = fd;
+    m_SinkOwned = owned;
+}
+
+// a SinkWriter thread, or the caller's straight from curl's buffer for sync requests
+bool WinHttpRequestImp::WriteToSink(const void *data, size_t len, int &error)
+{
+    const char *src = static_cast<const char *>(data);
+
+    while (len)
+    {
+        ssize_t written = write(m_SinkFd, src, len);
+
+        if (written < 0)
         {
-            request->GetResponseString().insert(request->GetResponseString().end(),
-                reinterpret_cast<const BYTE*>(buf),
-                reinterpret_cast<const BYTE*>(buf) + available);
+            if (errno == EINTR)
+                continue;
 
-            read += available;
+            error = errno;
+            TRACE("%-35s:%-8d:%-16p fd:%d errno:%d\n", __func__, __LINE__, (void*)this, m_SinkFd, error);
+            return false;
         }
+
+        src += written;
+        len -= written;
+        m_SinkWritten += written;
     }
+    return true;
+}
 
-    if (request->GetAsync()) {
-        if (available && request->HandleQueryDataNotifications(srequest, available))
-            TRACE("%-35s:%-8d:%-16p GetQueryDataEvent().notify_all\n", __func__, __LINE__, (void*)request);
+// engine thread with GetBodyStringMutex held, the body goes to the writer rather than to the fd
+size_t WinHttpRequestImp::QueueToSink(std::shared_ptr<WinHttpRequestImp> &srequest, const void *data, size_t len)
+{
+    if (m_SinkError)
+        return 0;
+
+    // libcurl re-delivers the chunk on resume, once the writer brought the buffer below the low watermark
+    if (PauseForFlowControl())
+    {
+        NotePaused(CURLPAUSE_RECV);
+        return CURL_WRITEFUNC_PAUSE;
     }
 
-    return read;
+    m_ResponseBuffer.append(data, len);
+    if (!m_SinkQueued && SinkWriter::GetInstance().Queue(srequest))
+        m_SinkQueued = true;
+
+    return m_SinkQueued ? len : 0;
 }
 
-void WinHttpRequestImp::ConsumeIncoming(std::shared_ptr<WinHttpRequestImp> &srequest, void* &ptr, size_t &available, size_t &read)
+// SinkWriter thread, writes until the buffer is empty and completes the transfer if it already ended
+void WinHttpRequestImp::DrainSink(std::shared_ptr<WinHttpRequestImp> &srequest)
 {
-    while (available)
+    std::unique_lock<std::mutex> lck(GetBodyStringMutex());
+    bool done;
+    CURLcode code;
+
+    while (!m_SinkError && !GetClosing())
     {
-        BufferRequest buf = GetBufferRequest(srequest->GetOutstandingReads());
-        if (!buf.m_Length)
+        const void *data;
+        size_t len = m_ResponseBuffer.borrow(&data);
+        int error = 0;
+
+        if (!len)
             break;
 
-        size_t len = MIN(buf.m_Length, available);
+        // appends from the engine leave the borrowed block in place
+        lck.unlock();
+        WriteToSink(data, len, error);
+        lck.lock();
 
-        if (len)
-        {
-            TRACE("%-35s:%-8d:%-16p reading length:%lu written:%lu %p %ld\n",
-                __func__, __LINE__, (void*)srequest.get(), len, read, buf.m_Buffer, buf.m_Length);
-            memcpy(static_cast<char*>(buf.m_Buffer), ptr, len);
-        }
+        m_ResponseBuffer.release(len);
+        m_SinkError = error;
 
-        ptr = static_cast<char*>(ptr) + len;
-        available -= len;
+        lck.unlock();
+        ResumeIfDrained(srequest, false);
+        lck.lock();
+    }
 
-        if (len)
-        {
-            LPVOID StatusInformation = buf.m_Buffer;
+    if (m_SinkError || GetClosing())
+        m_ResponseBuffer.clear();
 
-            TRACE("%-35s:%-8d:%-16p WINHTTP_CALLBACK_STATUS_READ_COMPLETE lpBuffer: %p length:%lu\n", __func__, __LINE__, (void*)srequest.get(), buf.m_Buffer, len);
-            srequest->AsyncQueue(srequest, WINHTTP_CALLBACK_STATUS_READ_COMPLETE, len, StatusInformation, sizeof(StatusInformation), false);
-        }
+    m_SinkQueued = false;
+    done = m_SinkDone;
+    code = m_SinkCode;
+    m_SinkDone = false;
+    lck.unlock();
 
-        read += len;
-    }
+    if (done)
+        CompleteSink(srequest, code);
+    else if (m_SinkError)
+        ResumeIfDrained(srequest, true);    // the next write callback fails the transfer
 }
 
-void WinHttpRequestImp::FlushIncoming(std::shared_ptr<WinHttpRequestImp> &srequest)
+// engine thread with GetBodyStringMutex held, the writer reports the end if it still has bytes to write
+void WinHttpRequestImp::FinishSink(std::shared_ptr<WinHttpRequestImp> &srequest, CURLcode code)
 {
-    while (1)
+    if (m_SinkQueued)
     {
-        BufferRequest buf = GetBufferRequest(srequest->GetOutstandingReads());
-        if (!buf.m_Length)
-            break;
+        m_SinkDone = true;
+        m_SinkCode = code;
+        return;
+    }
 
-        LPVOID StatusInformation = buf.m_Buffer;
+    CompleteSink(srequest, code);
+}
 
-        TRACE("%-35s:%-8d:%-16p WINHTTP_CALLBACK_STATUS_READ_COMPLETE lpBuffer: %p length:%d\n", __func__, __LINE__, (void*)srequest.get(), buf.m_Buffer, 0);
-        srequest->AsyncQueue(srequest, WINHTTP_CALLBACK_STATUS_READ_COMPLETE, 0, StatusInformation, sizeof(StatusInformation), false);
+void WinHttpRequestImp::CompleteSink(std::shared_ptr<WinHttpRequestImp> &srequest, CURLcode code)
+{
+    WINHTTP_SINK_RESULT result = { 0, 0, 0 };
+
+    result.ullBytesWritten = m_SinkWritten;
+    if (m_SinkError)
+    {
+        result.dwError = ERROR_WRITE_FAULT;
+        result.dwSystemError = m_SinkError;
     }
+    else if (code == CURLE_OK)
+        result.dwError = ERROR_SUCCESS;
+    else if (code == CURLE_OPERATION_TIMEDOUT)
+        result.dwError = ERROR_WINHTTP_TIMEOUT;
+    else
+        result.dwError = ERROR_WINHTTP_OPERATION_CANCELLED;
+
+    TRACE("%-35s:%-8d:%-16p written:%llu error:%lu errno:%lu\n", __func__, __LINE__, (void*)this, result.ullBytesWritten,
+          result.dwError, result.dwSystemError);
+    AsyncQueue(srequest, WINHTTP_CALLBACK_STATUS_SINK_COMPLETE, sizeof(result), &result, sizeof(result), true);
 }
 
-void WinHttpRequestImp::CleanUp()
+// false while a borrowed view or the sink writer still points into the response buffer, nothing is reset then
+bool WinHttpRequestImp::CleanUp()
 {
+    {
+        std::lock_guard<std::mutex> lck(GetBodyStringMutex());
+
+        if (m_ResponseBuffer.lent() || m_SinkQueued)
+        {
+            TRACE("%-35s:%-8d:%-16p response buffer in use\n", __func__, __LINE__, (void*)this);
+            return false;
+        }
+
+        m_ResponseBuffer.clear();
+        m_SinkWritten = 0;
+        m_SinkError = 0;
+        m_SinkDone = false;
+    }
     m_CompletionCode = CURLE_OK;
-    m_ResponseString.clear();
     m_HeaderString.clear();
     m_TotalReceiveSize = 0;
     m_ReadData.clear();
@@ -1230,6 +3036,7 @@ void WinHttpRequestImp::CleanUp()
     m_OutstandingWrites.clear();
     m_OutstandingReads.clear();
     m_Completion = false;
+    return true;
 }
 
 WinHttpRequestImp::WinHttpRequestImp():
@@ -1239,18 +3046,30 @@ WinHttpRequestImp::WinHttpRequestImp():
             m_ReceiveResponseEventCounter(0),
             m_RedirectPending(false)
 {
-    m_curl = ComContainer::GetInstance().AllocCURL();
+    m_curl = ComContainer::AllocCURL();
     if (!m_curl)
         return;
 }
 
+void WinHttpRequestImp::SetEngine(ComContainer *engine)
+{
+    if (engine == m_Engine)
+        return;
+
+    if (engine)
+        engine->AddRef();
+    if (m_Engine)
+        m_Engine->Release();
+    m_Engine = engine;
+}
+
 WinHttpRequestImp::~WinHttpRequestImp()
 {
     TRACE("%-35s:%-8d:%-16p\n", __func__, __LINE__, (void*)this);
 
     m_closed = true;
 
-    if (!GetAsync() && Uploading())
+    if (!GetAsync() && HasUploadThread())
     {
         {
             std::lock_guard<std::mutex> lck(GetReadDataEventMtx());
@@ -1266,12 +3085,17 @@ WinHttpRequestImp::~WinHttpRequestImp()
         curl_easy_getinfo(GetCurl(), CURLINFO_PRIVATE, NULL);
 
     /* always cleanup */
-    ComContainer::GetInstance().FreeCURL(m_curl);
+    ComContainer::FreeCURL(m_curl);
+
+    SetSink(-1, false);
 
     /* free the custom headers */
     if (m_HeaderList)
         curl_slist_free_all(m_HeaderList);
 
+    // last, the engine may go with it
+    SetEngine(NULL);
+
     TRACE("%-35s:%-8d:%-16p\n", __func__, __LINE__, (void*)this);
 }
 
@@ -1284,6 +3108,30 @@ static void RequestCompletionCb(std::shared_ptr<WinHttpRequestImp> &requestRef,
     }
 }
 
+// expand the group flags of WinHttpSetStatusCallback into the status bits they cover
+static DWORD NotificationMask(DWORD dwNotificationFlags)
+{
+    // shares its value with READ_COMPLETE, but a lone READ_COMPLETE subscription makes no sense
+    if (dwNotificationFlags == WINHTTP_CALLBACK_FLAG_ALL_NOTIFICATIONS)
+        return 0xffffffff;
+
+    DWORD mask = dwNotificationFlags;
+
+    if (dwNotificationFlags & WINHTTP_CALLBACK_FLAG_ALL_COMPLETIONS)
+        mask |= WINHTTP_CALLBACK_STATUS_SENDREQUEST_COMPLETE | WINHTTP_CALLBACK_STATUS_HEADERS_AVAILABLE |
+                WINHTTP_CALLBACK_STATUS_DATA_AVAILABLE | WINHTTP_CALLBACK_STATUS_READ_COMPLETE |
+                WINHTTP_CALLBACK_STATUS_WRITE_COMPLETE | WINHTTP_CALLBACK_STATUS_REQUEST_ERROR |
+                WINHTTP_CALLBACK_STATUS_SINK_COMPLETE;
+    if (dwNotificationFlags & WINHTTP_CALLBACK_FLAG_HANDLES)
+        mask |= WINHTTP_CALLBACK_STATUS_HANDLE_CLOSING;
+    if (dwNotificationFlags & WINHTTP_CALLBACK_FLAG_SECURE_FAILURE)
+        mask |= WINHTTP_CALLBACK_STATUS_SECURE_FAILURE;
+    if (dwNotificationFlags & WINHTTP_CALLBACK_FLAG_SEND_REQUEST)
+        mask |= WINHTTP_CALLBACK_STATUS_SENDING_REQUEST | WINHTTP_CALLBACK_STATUS_REQUEST_SENT;
+
+    return mask;
+}
+
 BOOL WinHttpRequestImp::AsyncQueue(std::shared_ptr<WinHttpRequestImp> &requestRef,
                                     DWORD dwInternetStatus, size_t statusInformationLength,
                                   LPVOID statusInformation, DWORD statusInformationCopySize,
@@ -1297,13 +3145,29 @@ BOOL WinHttpRequestImp::AsyncQueue(std::shared_ptr<WinHttpRequestImp> &requestRe
     if (!requestRef->GetAsync())
         return FALSE;
 
+    // nobody listens, only the internal completion work is left and it is cheap enough to run here
+    if (!cb || !(NotificationMask(dwNotificationFlags) & dwInternetStatus))
+    {
+        TRACE_VERBOSE("%-35s:%-8d:%-16p filtered dwInternetStatus:0x%lx flags:0x%lx\n", __func__, __LINE__, (void*)this,
+                      dwInternetStatus, dwNotificationFlags);
+        RequestCompletionCb(requestRef, dwInternetStatus);
+        return TRUE;
+    }
+
     userdata = GetUserData();
+    m_PendingNotifications.fetch_add(1, std::memory_order_seq_cst);
+    CallbackStats::Instance().Raised();
 
     ctx = new UserCallbackContext(requestRef, dwInternetStatus, static_cast<DWORD>(statusInformationLength),
                                     dwNotificationFlags, cb, userdata, statusInformation,
                                     statusInformationCopySize, allocate, RequestCompletionCb);
     if (ctx) {
-        UserCallbackContainer::GetInstance().Queue(ctx);
+        if (GetInlineCallbacks() && InlineCallbackScope::Active(GetEngine()))
+            InlineCallbackScope::Defer(ctx);
+        else if (GetInlineCallbacks() && GetEngine())
+            GetEngine()->PostNotification(ctx);
+        else
+            UserCallbackContainer::GetInstance().Queue(ctx);
     }
     else
         return FALSE;
@@ -1316,7 +3180,8 @@ BOOL WinHttpRequestImp::AsyncQueue(std::shared_ptr<WinHttpRequestImp> &requestRe
 size_t WinHttpRequestImp::ReadCallback(void *ptr, size_t size, size_t nmemb, void *userp)
 {
     WinHttpRequestImp *request = static_cast<WinHttpRequestImp *>(userp);
-    std::shared_ptr<WinHttpRequestImp> srequest = request->shared_from_this();
+    std::shared_ptr<WinHttpRequestImp> fallback;
+    std::shared_ptr<WinHttpRequestImp> &srequest = request->PinnedRef(fallback);
     if (!srequest)
         return size * nmemb;
 
@@ -1344,6 +3209,7 @@ size_t WinHttpRequestImp::ReadCallback(void *ptr, size_t size, size_t nmemb, voi
         if (!request->GetReadDataEventCounter())
         {
             TRACE("%-35s:%-8d:%-16p transfer paused:%lu\n", __func__, __LINE__, (void*)request, size * nmemb);
+            request->NotePaused(CURLPAUSE_SEND);
             return CURL_READFUNC_PAUSE;
         }
         TRACE("%-35s:%-8d:%-16p transfer resumed as already signalled:%lu\n", __func__, __LINE__, (void*)request, size * nmemb);
@@ -1394,12 +3260,9 @@ size_t WinHttpRequestImp::ReadCallback(void *ptr, size_t size, size_t nmemb, voi
     {
         request->GetReadDataEventMtx().lock();
         request->GetReadDataEventCounter()--;
-        len = MIN(request->GetReadData().size(), size * nmemb);
+        len = request->GetReadData().read(ptr, size * nmemb);
         TRACE("%-35s:%-8d:%-16p writing additional length:%lu\n", __func__, __LINE__, (void*)request, len);
-        std::copy(request->GetReadData().begin(), request->GetReadData().begin() + len, static_cast<char*>(ptr));
         request->GetReadLength() += len;
-        request->GetReadData().erase(request->GetReadData().begin(), request->GetReadData().begin() + len);
-        request->GetReadData().shrink_to_fit();
         request->GetReadDataEventMtx().unlock();
     }
     return len;
@@ -1454,7 +3317,7 @@ bool WinHttpRequestImp::HandleQueryDataNotifications(std::shared_ptr<WinHttpRequ
             size_t length;
 
             GetBodyStringMutex().lock();
-            length = GetResponseString().size();
+            length = GetResponseBuffer().size();
             available = length;
             GetBodyStringMutex().unlock();
         }
@@ -1588,6 +3451,11 @@ BOOLAPI WinHttpCloseHandle(
             return FALSE;
 
         request->GetClosing() = true;
+
+        request->ResumeAll(srequest);
+
+        if (request->GetEngine() && request->GetHostConnectionLimit())
+            request->GetEngine()->CancelPending(srequest);
         WinHttpHandleContainer<WinHttpRequestImp>::Instance().UnRegister(request);
         return TRUE;
     }
@@ -1690,6 +3558,8 @@ WINHTTPAPI HINTERNET WINAPI WinHttpOpenRequest(
         request->GetSecure() = false;
     }
 
+    request->GetHostHash() = std::hash<std::string>()(server) ^ static_cast<size_t>(session->GetServerPort());
+
     if (server.find("http://") == std::string::npos)
         server = prefix + server;
     if (pwszObjectName)
@@ -1725,7 +3595,7 @@ WINHTTPAPI HINTERNET WINAPI WinHttpOpenRequest(
 
     if (session->GetConnectionTimeoutMs() > 0)
     {
-        res = curl_easy_setopt(request->GetCurl(), CURLOPT_CONNECTTIMEOUT, session->GetConnectionTimeoutMs()/1000);
+        res = curl_easy_setopt(request->GetCurl(), CURLOPT_CONNECTTIMEOUT_MS, session->GetConnectionTimeoutMs());
         CURL_BAILOUT_ONERROR(res, request, NULL);
     }
 
@@ -1883,6 +3753,63 @@ WINHTTPAPI HINTERNET WINAPI WinHttpOpenRequest(
             CURL_BAILOUT_ONERROR(res, request, NULL);
         }
     }
+
+    /* callbacks and transport options that do not change between sends of this handle */
+    res = curl_easy_setopt(request->GetCurl(), CURLOPT_READDATA, request);
+    CURL_BAILOUT_ONERROR(res, request, NULL);
+
+    res = curl_easy_setopt(request->GetCurl(), CURLOPT_READFUNCTION, request->ReadCallback);
+    CURL_BAILOUT_ONERROR(res, request, NULL);
+
+    res = curl_easy_setopt(request->GetCurl(), CURLOPT_DEBUGFUNCTION, request->SocketCallback);
+    CURL_BAILOUT_ONERROR(res, request, NULL);
+
+    res = curl_easy_setopt(request->GetCurl(), CURLOPT_DEBUGDATA, request);
+    CURL_BAILOUT_ONERROR(res, request, NULL);
+
+    res = curl_easy_setopt(request->GetCurl(), CURLOPT_WRITEFUNCTION, request->WriteBodyFunction);
+    CURL_BAILOUT_ONERROR(res, request, NULL);
+
+    res = curl_easy_setopt(request->GetCurl(), CURLOPT_WRITEDATA, request);
+    CURL_BAILOUT_ONERROR(res, request, NULL);
+
+    res = curl_easy_setopt(request->GetCurl(), CURLOPT_HEADERFUNCTION, request->WriteHeaderFunction);
+    CURL_BAILOUT_ONERROR(res, request, NULL);
+
+    res = curl_easy_setopt(request->GetCurl(), CURLOPT_HEADERDATA, request);
+    CURL_BAILOUT_ONERROR(res, request, NULL);
+
+    res = curl_easy_setopt(request->GetCurl(), CURLOPT_PRIVATE, request);
+    CURL_BAILOUT_ONERROR(res, request, NULL);
+
+    res = curl_easy_setopt(request->GetCurl(), CURLOPT_FOLLOWLOCATION, 1L);
+    CURL_BAILOUT_ONERROR(res, request, NULL);
+
+    if (winhttp_tracing_verbose)
+    {
+        res = curl_easy_setopt(request->GetCurl(), CURLOPT_VERBOSE, 1);
+        CURL_BAILOUT_ONERROR(res, request, NULL);
+    }
+
+    /* enable TCP keep-alive for this transfer */
+    res = curl_easy_setopt(request->GetCurl(), CURLOPT_TCP_KEEPALIVE, 1L);
+    CURL_BAILOUT_ONERROR(res, request, NULL);
+
+    /* keep-alive idle time to 120 seconds */
+    res = curl_easy_setopt(request->GetCurl(), CURLOPT_TCP_KEEPIDLE, 120L);
+    CURL_BAILOUT_ONERROR(res, request, NULL);
+
+    /* interval time between keep-alive probes: 60 seconds */
+    res = curl_easy_setopt(request->GetCurl(), CURLOPT_TCP_KEEPINTVL, 60L);
+    CURL_BAILOUT_ONERROR(res, request, NULL);
+
+    // wait for a connection that can multiplex this transfer rather than opening another one, only
+    // TLS negotiates HTTP/2 here, cleartext transfers would queue behind a single HTTP/1.1 connection
+    if (winhttp_multiplex && request->GetSecure()) {
+        res = curl_easy_setopt(request->GetCurl(), CURLOPT_PIPEWAIT, 1L);
+        CURL_BAILOUT_ONERROR(res, request, NULL);
+    }
+
     if (pwszVerb)
     {
         ConvertCstrAssign(pwszVerb, WCTLEN(pwszVerb), request->GetType());
@@ -1933,9 +3860,9 @@ WinHttpAddRequestHeaders
     return TRUE;
 }
 
-BOOLAPI WinHttpSendRequest
+static BOOL PrepareSendRequest
 (
-    HINTERNET hRequest,
+    WinHttpRequestImp *request,
     LPCTSTR lpszHeaders,
     DWORD dwHeadersLength,
     LPVOID lpOptional,
@@ -1945,9 +3872,6 @@ BOOLAPI WinHttpSendRequest
 )
 {
     CURLcode res;
-    WinHttpRequestImp *request = static_cast<WinHttpRequestImp *>(hRequest);
-    if (!request)
-        return FALSE;
 
     WinHttpConnectImp *connect = request->GetSession();
     if (!connect)
@@ -1955,10 +3879,6 @@ BOOLAPI WinHttpSendRequest
 
     WinHttpSessionImp *session = connect->GetHandle();
 
-    std::shared_ptr<WinHttpRequestImp> srequest = request->shared_from_this();
-    if (!srequest)
-        return FALSE;
-
     TSTRING customHeader;
 
     if (dwHeadersLength == (DWORD)-1)
@@ -1975,7 +3895,7 @@ BOOLAPI WinHttpSendRequest
     TRACE("%-35s:%-8d:%-16p lpszHeaders:%p dwHeadersLength:%lu lpOptional:%p dwOptionalLength:%lu dwTotalLength:%lu\n",
         __func__, __LINE__, (void*)request, (const void*)lpszHeaders, dwHeadersLength, lpOptional, dwOptionalLength, dwTotalLength);
 
-    if (!customHeader.empty() && !WinHttpAddRequestHeaders(hRequest, customHeader.c_str(), customHeader.length(), 0))
+    if (!customHeader.empty() && !WinHttpAddRequestHeaders(request, customHeader.c_str(), customHeader.length(), 0))
         return FALSE;
 
     if (lpOptional)
@@ -2031,120 +3951,175 @@ BOOLAPI WinHttpSendRequest
         CURL_BAILOUT_ONERROR(res, request, FALSE);
     }
 
-    res = curl_easy_setopt(request->GetCurl(), CURLOPT_BUFFERSIZE, WINHTTP_CURL_MAX_WRITE_SIZE);
-    CURL_BAILOUT_ONERROR(res, request, FALSE);
-
     request->GetTotalLength() = dwTotalLength;
-    res = curl_easy_setopt(request->GetCurl(), CURLOPT_READDATA, request);
+    res = curl_easy_setopt(request->GetCurl(), CURLOPT_SSL_VERIFYPEER, request->VerifyPeer());
     CURL_BAILOUT_ONERROR(res, request, FALSE);
 
-    res = curl_easy_setopt(request->GetCurl(), CURLOPT_READFUNCTION, request->ReadCallback);
+    res = curl_easy_setopt(request->GetCurl(), CURLOPT_SSL_VERIFYHOST, request->VerifyHost());
     CURL_BAILOUT_ONERROR(res, request, FALSE);
 
-    res = curl_easy_setopt(request->GetCurl(), CURLOPT_DEBUGFUNCTION, request->SocketCallback);
-    CURL_BAILOUT_ONERROR(res, request, FALSE);
+    DWORD maxConnections = 0;
 
-    res = curl_easy_setopt(request->GetCurl(), CURLOPT_DEBUGDATA, request);
-    CURL_BAILOUT_ONERROR(res, request, FALSE);
+    if (request->GetMaxConnections())
+        maxConnections = request->GetMaxConnections();
+    else if (session->GetMaxConnections())
+        maxConnections = session->GetMaxConnections();
 
-    res = curl_easy_setopt(request->GetCurl(), CURLOPT_WRITEFUNCTION, request->WriteBodyFunction);
-    CURL_BAILOUT_ONERROR(res, request, FALSE);
+    // async transfers share the engine's connections, the engine queues the ones over this session's cap for the host
+    request->GetHostConnectionLimit() = maxConnections;
+    request->GetSessionSerial() = session->GetSerial();
 
-    res = curl_easy_setopt(request->GetCurl(), CURLOPT_WRITEDATA, request);
-    CURL_BAILOUT_ONERROR(res, request, FALSE);
+    if (request->GetMaxResponseBufferSize())
+        request->GetResponseBufferLimit() = request->GetMaxResponseBufferSize();
+    else if (session->GetMaxResponseBufferSize())
+        request->GetResponseBufferLimit() = session->GetMaxResponseBufferSize();
+    else
+        request->GetResponseBufferLimit() = winhttp_max_buffered_bytes;
 
-    res = curl_easy_setopt(request->GetCurl(), CURLOPT_HEADERFUNCTION, request->WriteHeaderFunction);
-    CURL_BAILOUT_ONERROR(res, request, FALSE);
+    DWORD bufferSize = winhttp_receive_buffer_size;
+    long curlBufferSize = WINHTTP_CURL_MAX_WRITE_SIZE;
 
-    res = curl_easy_setopt(request->GetCurl(), CURLOPT_HEADERDATA, request);
-    CURL_BAILOUT_ONERROR(res, request, FALSE);
+    if (request->GetReceiveBufferSize())
+        bufferSize = request->GetReceiveBufferSize();
+    else if (session->GetReceiveBufferSize())
+        bufferSize = session->GetReceiveBufferSize();
 
-    res = curl_easy_setopt(request->GetCurl(), CURLOPT_PRIVATE, request);
-    CURL_BAILOUT_ONERROR(res, request, FALSE);
+    request->GetReceiveBufferSizer().reset();
+    if (bufferSize == WINHTTP_RECEIVE_BUFFER_SIZE_ADAPTIVE)
+    {
+        request->GetReceiveBufferSizer() = session->GetReceiveBufferSizer();
+        curlBufferSize = request->GetReceiveBufferSizer()->Pick(request->GetResponseBufferLimit());
+    }
+    else if (bufferSize)
+        curlBufferSize = static_cast<long>(bufferSize);
 
-    res = curl_easy_setopt(request->GetCurl(), CURLOPT_FOLLOWLOCATION, 1L);
+    TRACE("%-35s:%-8d:%-16p receive buffer:%ld\n", __func__, __LINE__, (void*)request, curlBufferSize);
+    res = curl_easy_setopt(request->GetCurl(), CURLOPT_BUFFERSIZE, curlBufferSize);
     CURL_BAILOUT_ONERROR(res, request, FALSE);
+    if (maxConnections && !request->GetAsync()) {
+        res = curl_easy_setopt(request->GetCurl(), CURLOPT_MAXCONNECTS, maxConnections);
+        CURL_BAILOUT_ONERROR(res, request, FALSE);
+    }
 
-    if (winhttp_tracing_verbose)
-    {
-        res = curl_easy_setopt(request->GetCurl(), CURLOPT_VERBOSE, 1);
+    if (dwContext)
+        request->SetUserData(reinterpret_cast<void**>(&dwContext));
+
+    DWORD securityProtocols = 0;
+
+    if (request->GetSecureProtocol())
+        securityProtocols = request->GetSecureProtocol();
+    else if (session->GetSecureProtocol())
+        securityProtocols = session->GetSecureProtocol();
+
+    if (securityProtocols) {
+        res = curl_easy_setopt(request->GetCurl(), CURLOPT_SSLVERSION, securityProtocols);
         CURL_BAILOUT_ONERROR(res, request, FALSE);
     }
 
-    /* enable TCP keep-alive for this transfer */
-    res = curl_easy_setopt(request->GetCurl(), CURLOPT_TCP_KEEPALIVE, 1L);
-    CURL_BAILOUT_ONERROR(res, request, FALSE);
+    return TRUE;
+}
 
-    /* keep-alive idle time to 120 seconds */
-    res = curl_easy_setopt(request->GetCurl(), CURLOPT_TCP_KEEPIDLE, 120L);
-    CURL_BAILOUT_ONERROR(res, request, FALSE);
+// resets the request and picks its engine, the caller hands it to ComContainer::AddHandle(s)
+static ComContainer *BeginAsyncSend(std::shared_ptr<WinHttpRequestImp> &srequest)
+{
+    WinHttpRequestImp *request = srequest.get();
 
-    /* interval time between keep-alive probes: 60 seconds */
-    res = curl_easy_setopt(request->GetCurl(), CURLOPT_TCP_KEEPINTVL, 60L);
-    CURL_BAILOUT_ONERROR(res, request, FALSE);
+    if (request->GetClosing())
+    {
+        TRACE("%-35s:%-8d:%-16p \n", __func__, __LINE__, (void*)request);
+        return NULL;
+    }
 
-    res = curl_easy_setopt(request->GetCurl(), CURLOPT_SSL_VERIFYPEER, request->VerifyPeer());
-    CURL_BAILOUT_ONERROR(res, request, FALSE);
+    // a view from WinHttpReadDataBorrow has to be released before the request is sent again
+    if (!request->CleanUp())
+    {
+        SetLastError(ERROR_WINHTTP_INCORRECT_HANDLE_STATE);
+        return NULL;
+    }
+
+    WinHttpSessionImp *session = request->GetSession()->GetHandle();
+    ComContainer *engine = session->GetEngine();
+
+    if (!engine)
+    {
+        // a MAX_CONNS_PER_SERVER cap is enforced by the engine, every transfer it covers has to land on the same one
+        engine = &ComContainer::GetInstance(request->GetHostHash(), request->GetHostConnectionLimit() != 0);
+    }
+
+    if (!engine->IsRunning())
+    {
+        TRACE("%-35s:%-8d:%-16p engine not running\n", __func__, __LINE__, (void*)request);
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+
+    // counted from here rather than when the engine takes it, so a burst or a batch spreads over the shards
+    engine->Reserve();
 
-    res = curl_easy_setopt(request->GetCurl(), CURLOPT_SSL_VERIFYHOST, request->VerifyHost());
-    CURL_BAILOUT_ONERROR(res, request, FALSE);
+    // before the first notification, so every one of this send takes the same path
+    request->SetEngine(engine);
+    request->GetInlineCallbacks() = session->GetInlineCallbacks() || request->GetCompletionRoutine();
 
-    DWORD maxConnections = 0;
+    request->AsyncQueue(srequest, WINHTTP_CALLBACK_STATUS_SENDING_REQUEST, 0, NULL, 0, false);
+    return engine;
+}
 
-    if (request->GetMaxConnections())
-        maxConnections = request->GetMaxConnections();
-    else if (session->GetMaxConnections())
-        maxConnections = session->GetMaxConnections();
+static void CompleteAsyncSend(std::shared_ptr<WinHttpRequestImp> &srequest)
+{
+    WinHttpRequestImp *request = srequest.get();
 
-    if (maxConnections) {
-        res = curl_easy_setopt(request->GetCurl(), CURLOPT_MAXCONNECTS, maxConnections);
-        CURL_BAILOUT_ONERROR(res, request, FALSE);
-    }
+    request->AsyncQueue(srequest, WINHTTP_CALLBACK_STATUS_REQUEST_SENT, 0, NULL, 0, false);
+    request->AsyncQueue(srequest, WINHTTP_CALLBACK_STATUS_SENDREQUEST_COMPLETE, 0, NULL, 0, false);
 
-    if (dwContext)
-        request->SetUserData(reinterpret_cast<void**>(&dwContext));
+    TRACE("%-35s:%-8d:%-16p use_count = %lu\n", __func__, __LINE__, (void*)request, srequest.use_count());
+}
 
-    DWORD securityProtocols = 0;
+BOOLAPI WinHttpSendRequest
+(
+    HINTERNET hRequest,
+    LPCTSTR lpszHeaders,
+    DWORD dwHeadersLength,
+    LPVOID lpOptional,
+    DWORD dwOptionalLength,
+    DWORD dwTotalLength,
+    DWORD_PTR dwContext
+)
+{
+    CURLcode res;
+    WinHttpRequestImp *request = static_cast<WinHttpRequestImp *>(hRequest);
+    if (!request)
+        return FALSE;
 
-    if (request->GetSecureProtocol())
-        securityProtocols = request->GetSecureProtocol();
-    else if (session->GetSecureProtocol())
-        securityProtocols = session->GetSecureProtocol();
+    std::shared_ptr<WinHttpRequestImp> srequest = request->shared_from_this();
+    if (!srequest)
+        return FALSE;
 
-    if (securityProtocols) {
-        res = curl_easy_setopt(request->GetCurl(), CURLOPT_SSLVERSION, securityProtocols);
-        CURL_BAILOUT_ONERROR(res, request, FALSE);
-    }
+    if (!PrepareSendRequest(request, lpszHeaders, dwHeadersLength, lpOptional, dwOptionalLength, dwTotalLength, dwContext))
+        return FALSE;
 
     if (request->GetAsync())
     {
-        if (request->GetClosing())
-        {
-            TRACE("%-35s:%-8d:%-16p \n", __func__, __LINE__, (void*)request);
+        ComContainer *engine = BeginAsyncSend(srequest);
+        if (!engine)
             return FALSE;
-        }
 
-        request->CleanUp();
-        request->AsyncQueue(srequest, WINHTTP_CALLBACK_STATUS_SENDING_REQUEST, 0, NULL, 0, false);
-
-        if (!ComContainer::GetInstance().AddHandle(srequest, request->GetCurl()))
+        if (!engine->AddHandle(srequest))
             return FALSE;
 
-        ComContainer::GetInstance().KickStart();
-
-        request->AsyncQueue(srequest, WINHTTP_CALLBACK_STATUS_REQUEST_SENT, 0, NULL, 0, false);
-        request->AsyncQueue(srequest, WINHTTP_CALLBACK_STATUS_SENDREQUEST_COMPLETE, 0, NULL, 0, false);
-
-        TRACE("%-35s:%-8d:%-16p use_count = %lu\n", __func__, __LINE__, (void*)request, srequest.use_count());
+        CompleteAsyncSend(srequest);
     }
     else
     {
         if (dwTotalLength && (request->GetType() != "POST"))
         {
-            DWORD thread_id;
-            request->GetUploadThread() = CREATETHREAD(
+            if (!CreateWinHttpThread(request->GetUploadThread(),
                 WinHttpRequestImp::UploadThreadFunction,       // thread function name
-                request, &thread_id);          // argument to thread function
+                request, WINHTTP_THREAD_UPLOAD, 0))          // argument to thread function
+            {
+                SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+                return FALSE;
+            }
+            request->HasUploadThread() = true;
         }
         else
         {
@@ -2152,12 +4127,77 @@ BOOLAPI WinHttpSendRequest
             res = curl_easy_perform(request->GetCurl());
             /* Check for errors */
             CURL_BAILOUT_ONERROR(res, request, FALSE);
+            request->RecordReceivedBody();
         }
     }
 
     return TRUE;
 }
 
+BOOLAPI WinHttpSendRequestBatch
+(
+    WINHTTP_SEND_REQUEST_BATCH_ITEM *pItems,
+    DWORD dwCount
+)
+{
+    std::vector<std::shared_ptr<WinHttpRequestImp>> submitted;
+    std::map<ComContainer *, std::vector<std::shared_ptr<WinHttpRequestImp>>> perEngine;
+    BOOL allSubmitted = TRUE;
+
+    if (!pItems && dwCount)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    TRACE("%-35s:%-8d:%-16p dwCount:%lu\n", __func__, __LINE__, (void*)pItems, dwCount);
+
+    for (DWORD i = 0; i < dwCount; i++)
+    {
+        WINHTTP_SEND_REQUEST_BATCH_ITEM &item = pItems[i];
+        WinHttpRequestImp *request = static_cast<WinHttpRequestImp *>(item.hRequest);
+
+        item.dwError = ERROR_INVALID_PARAMETER;
+        if (!request || !request->GetAsync())
+        {
+            allSubmitted = FALSE;
+            continue;
+        }
+
+        std::shared_ptr<WinHttpRequestImp> srequest = request->shared_from_this();
+
+        SetLastError(ERROR_SUCCESS);
+        if (!PrepareSendRequest(request, item.lpszHeaders, item.dwHeadersLength, item.lpOptional,
+                                item.dwOptionalLength, item.dwTotalLength, item.dwContext))
+        {
+            if (GetLastError() != ERROR_SUCCESS)
+                item.dwError = GetLastError();
+            allSubmitted = FALSE;
+            continue;
+        }
+
+        ComContainer *engine = BeginAsyncSend(srequest);
+        if (!engine)
+        {
+            allSubmitted = FALSE;
+            continue;
+        }
+
+        item.dwError = ERROR_SUCCESS;
+        perEngine[engine].push_back(srequest);
+        submitted.push_back(srequest);
+    }
+
+    // one command list and one wakeup per engine for the whole batch
+    for (auto &it : perEngine)
+        it.first->AddHandles(it.second);
+
+    for (auto &srequest : submitted)
+        CompleteAsyncSend(srequest);
+
+    return allSubmitted;
+}
+
 WINHTTPAPI
 BOOL
 WINAPI
@@ -2187,7 +4227,8 @@ WinHttpReceiveResponse
                 TRACE("%-35s:%-8d:%-16p\n", __func__, __LINE__, (void*)request);
             }
 
-            ComContainer::GetInstance().ResumeTransfer(request->GetCurl(), CURLPAUSE_CONT);
+            if (request->GetEngine())
+                request->GetEngine()->ResumeTransfer(srequest, CURLPAUSE_SEND);
         }
     }
 
@@ -2248,7 +4289,7 @@ WinHttpQueryDataAvailable
     size_t length;
 
     request->GetBodyStringMutex().lock();
-    length = request->GetResponseString().size();
+    length = request->GetResponseBuffer().size();
     size_t available = length;
     request->GetBodyStringMutex().unlock();
 
@@ -2259,7 +4300,7 @@ WinHttpQueryDataAvailable
             TRACE("%-35s:%-8d:%-16p !!!!!!!\n", __func__, __LINE__, (void*)request);
             request->WaitAsyncQueryDataCompletion(srequest);
             request->GetBodyStringMutex().lock();
-            length = request->GetResponseString().size();
+            length = request->GetResponseBuffer().size();
             available = length;
             TRACE("%-35s:%-8d:%-16p available = %lu\n", __func__, __LINE__, (void*)request, available);
             request->GetBodyStringMutex().unlock();
@@ -2324,17 +4365,14 @@ WinHttpReadData
     }
 
     request->GetBodyStringMutex().lock();
-    readLength = request->GetResponseString().size();
-    if (readLength)
+    if (request->GetResponseBuffer().lent())
     {
-        if (readLength > dwNumberOfBytesToRead)
-        {
-            readLength = dwNumberOfBytesToRead;
-        }
-        std::copy(request->GetResponseString().begin(), request->GetResponseString().begin() + readLength, static_cast<char *>(lpBuffer));
-        request->GetResponseString().erase(request->GetResponseString().begin(), request->GetResponseString().begin() + readLength);
-        request->GetResponseString().shrink_to_fit();
+        request->GetBodyStringMutex().unlock();
+        TRACE("%-35s:%-8d:%-16p borrowed data not released\n", __func__, __LINE__, (void*)request);
+        SetLastError(ERROR_WINHTTP_INCORRECT_HANDLE_STATE);
+        return FALSE;
     }
+    readLength = request->GetResponseBuffer().read(lpBuffer, dwNumberOfBytesToRead);
 
     if (request->GetAsync())
     {
@@ -2353,12 +4391,98 @@ WinHttpReadData
     }
     request->GetBodyStringMutex().unlock();
 
+    if (request->GetAsync())
+        request->ResumeIfDrained(srequest, false);
+
     if (lpdwNumberOfBytesRead)
         *lpdwNumberOfBytesRead = (DWORD)readLength;
     TRACE("%-35s:%-8d:%-16p\n", __func__, __LINE__, (void*)request);
     return TRUE;
 }
 
+BOOLAPI
+WinHttpReadDataBorrow
+(
+    HINTERNET hRequest,
+    LPCVOID *lplpBuffer,
+    LPDWORD lpdwLength
+)
+{
+    WinHttpRequestImp *request = static_cast<WinHttpRequestImp *>(hRequest);
+    if (!request || !lplpBuffer || !lpdwLength)
+        return FALSE;
+
+    std::shared_ptr<WinHttpRequestImp> srequest = request->shared_from_this();
+    if (!srequest)
+        return FALSE;
+
+    if (request->GetClosing())
+    {
+        TRACE("%-35s:%-8d:%-16p \n", __func__, __LINE__, (void*)request);
+        return FALSE;
+    }
+
+    std::lock_guard<std::mutex> lck(request->GetBodyStringMutex());
+    ChunkBuffer &buffer = request->GetResponseBuffer();
+
+    if (buffer.lent())
+    {
+        SetLastError(ERROR_WINHTTP_INCORRECT_HANDLE_STATE);
+        return FALSE;
+    }
+
+    size_t length = buffer.borrow(lplpBuffer);
+    if (!length && request->GetAsync() && !request->GetCompletionStatus())
+    {
+        TRACE("%-35s:%-8d:%-16p nothing buffered\n", __func__, __LINE__, (void*)request);
+        SetLastError(ERROR_IO_PENDING);
+        return FALSE;
+    }
+
+    TRACE_VERBOSE("%-35s:%-8d:%-16p lpBuffer:%p length:%lu\n", __func__, __LINE__, (void*)request, *lplpBuffer, length);
+    *lpdwLength = static_cast<DWORD>(length);
+    return TRUE;
+}
+
+BOOLAPI
+WinHttpReleaseData
+(
+    HINTERNET hRequest,
+    DWORD dwLength
+)
+{
+    WinHttpRequestImp *request = static_cast<WinHttpRequestImp *>(hRequest);
+    if (!request)
+        return FALSE;
+
+    std::shared_ptr<WinHttpRequestImp> srequest = request->shared_from_this();
+    if (!srequest)
+        return FALSE;
+
+    {
+        std::lock_guard<std::mutex> lck(request->GetBodyStringMutex());
+
+        if (!request->GetResponseBuffer().release(dwLength))
+        {
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return FALSE;
+        }
+
+        // reads queued while the view was held would otherwise wait for the next chunk
+        request->ConsumeBuffered(srequest);
+
+        // or for the end of a transfer that already completed
+        if (request->GetCompletionStatus() && (request->GetCompletionCode() == CURLE_OK) &&
+            request->GetResponseBuffer().empty())
+            request->FlushIncoming(srequest);
+    }
+
+    if (request->GetAsync())
+        request->ResumeIfDrained(srequest, false);
+
+    return TRUE;
+}
+
 BOOLAPI
 WinHttpSetTimeouts
 (
@@ -2385,7 +4509,7 @@ WinHttpSetTimeouts
     {
         res = curl_easy_setopt(request->GetCurl(), CURLOPT_TIMEOUT_MS, nReceiveTimeout);
         CURL_BAILOUT_ONERROR(res, request, FALSE);
-        res = curl_easy_setopt(request->GetCurl(), CURLOPT_CONNECTTIMEOUT, nConnectTimeout/1000);
+        res = curl_easy_setopt(request->GetCurl(), CURLOPT_CONNECTTIMEOUT_MS, (long)nConnectTimeout);
         CURL_BAILOUT_ONERROR(res, request, FALSE);
     }
     else
@@ -2702,6 +4826,32 @@ BOOLAPI WinHttpSetOption(
 
         return FALSE;
     }
+    else if (dwOption == WINHTTP_OPTION_MAX_RESPONSE_BUFFER_SIZE)
+    {
+        if (dwBufferLength != sizeof(DWORD))
+            return FALSE;
+
+        if (CallMemberFunction<WinHttpSessionImp, DWORD>(base, &WinHttpSessionImp::SetMaxResponseBufferSize, lpBuffer))
+            return TRUE;
+
+        if (CallMemberFunction<WinHttpRequestImp, DWORD>(base, &WinHttpRequestImp::SetMaxResponseBufferSize, lpBuffer))
+            return TRUE;
+
+        return FALSE;
+    }
+    else if (dwOption == WINHTTP_OPTION_RECEIVE_BUFFER_SIZE)
+    {
+        if (dwBufferLength != sizeof(DWORD))
+            return FALSE;
+
+        if (CallMemberFunction<WinHttpSessionImp, DWORD>(base, &WinHttpSessionImp::SetReceiveBufferSize, lpBuffer))
+            return TRUE;
+
+        if (CallMemberFunction<WinHttpRequestImp, DWORD>(base, &WinHttpRequestImp::SetReceiveBufferSize, lpBuffer))
+            return TRUE;
+
+        return FALSE;
+    }
     else if (dwOption == WINHTTP_OPTION_CONTEXT_VALUE)
     {
         if (dwBufferLength != sizeof(void*))
@@ -2744,6 +4894,64 @@ BOOLAPI WinHttpSetOption(
 
         return FALSE;
     }
+    else if (dwOption == WINHTTP_OPTION_INLINE_CALLBACKS)
+    {
+        if (dwBufferLength != sizeof(DWORD))
+            return FALSE;
+
+        if (CallMemberFunction<WinHttpSessionImp, DWORD>(base, &WinHttpSessionImp::SetInlineCallbacks, lpBuffer))
+            return TRUE;
+
+        return FALSE;
+    }
+    else if (dwOption == WINHTTP_OPTION_RESPONSE_SINK_FD)
+    {
+        WinHttpRequestImp *request;
+
+        if (!lpBuffer || (dwBufferLength != sizeof(int)))
+            return FALSE;
+
+        if (!(request = dynamic_cast<WinHttpRequestImp *>(base)))
+            return FALSE;
+
+        request->SetSink(*static_cast<int *>(lpBuffer), false);
+        return TRUE;
+    }
+    else if (dwOption == WINHTTP_OPTION_RESPONSE_SINK_PATH)
+    {
+        WinHttpRequestImp *request;
+        std::string path;
+
+        if (!lpBuffer || !dwBufferLength)
+            return FALSE;
+
+        if (!(request = dynamic_cast<WinHttpRequestImp *>(base)))
+            return FALSE;
+
+        ConvertCstrAssign(static_cast<const TCHAR *>(lpBuffer), dwBufferLength, path);
+
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1)
+        {
+            TRACE("%-35s:%-8d:%-16p open %s errno:%d\n", __func__, __LINE__, (void*)request, path.c_str(), errno);
+            return FALSE;
+        }
+
+        request->SetSink(fd, true);
+        return TRUE;
+    }
+    else if (dwOption == WINHTTP_OPTION_EVENT_LOOP_CALLBACKS)
+    {
+        WinHttpSessionImp *session;
+
+        if (dwBufferLength != sizeof(WINHTTP_EVENT_LOOP_CALLBACKS))
+            return FALSE;
+
+        if ((session = dynamic_cast<WinHttpSessionImp *>(base)))
+            return session->SetEventLoopCallbacks(static_cast<WINHTTP_EVENT_LOOP_CALLBACKS *>(lpBuffer));
+
+        return FALSE;
+    }
     else if (dwOption == WINHTTP_OPTION_SECURITY_FLAGS)
     {
         WinHttpRequestImp *request;
@@ -2785,6 +4993,55 @@ BOOLAPI WinHttpSetOption(
     return FALSE;
 }
 
+BOOLAPI WinHttpQueryCallbackStats
+(
+    WINHTTP_CALLBACK_STATS *pStats
+)
+{
+    if (!pStats || !CallbackStats::Instance().Query(pStats))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+BOOLAPI WinHttpProcessSocket
+(
+    HINTERNET hSession,
+    int fd,
+    DWORD dwEvents
+)
+{
+    WinHttpSessionImp *session = dynamic_cast<WinHttpSessionImp *>(static_cast<WinHttpBase *>(hSession));
+
+    if (!session || !session->GetEngine())
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    TRACE_VERBOSE("%-35s:%-8d:%-16p fd:%d events:%lu\n", __func__, __LINE__, (void*)session, fd, dwEvents);
+    return session->GetEngine()->ProcessSocket(fd, dwEvents);
+}
+
+BOOLAPI WinHttpProcessTimeout
+(
+    HINTERNET hSession
+)
+{
+    WinHttpSessionImp *session = dynamic_cast<WinHttpSessionImp *>(static_cast<WinHttpBase *>(hSession));
+
+    if (!session || !session->GetEngine())
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    TRACE_VERBOSE("%-35s:%-8d:%-16p\n", __func__, __LINE__, (void*)session);
+    return session->GetEngine()->ProcessTimeout();
+}
+
 WINHTTPAPI
 WINHTTP_STATUS_CALLBACK
 WINAPI
@@ -2823,6 +5080,40 @@ WinHttpSetStatusCallback
     return oldcb;
 }
 
+BOOLAPI WinHttpSetCompletionRoutine
+(
+    HINTERNET hRequest,
+    WINHTTP_STATUS_CALLBACK lpfnCompletion,
+    DWORD dwNotificationFlags
+)
+{
+    WinHttpRequestImp *request = static_cast<WinHttpRequestImp *>(hRequest);
+    if (!request)
+        return FALSE;
+
+    if (!WinHttpHandleContainer<WinHttpRequestImp>::Instance().IsRegistered(request) || !request->GetAsync())
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    TRACE("%-35s:%-8d:%-16p cb:%p flags:0x%lx\n", __func__, __LINE__, (void*)request,
+          reinterpret_cast<void*>(lpfnCompletion), dwNotificationFlags);
+
+    if (!lpfnCompletion)
+    {
+        WinHttpSessionImp *session = request->GetSession()->GetHandle();
+
+        lpfnCompletion = session->GetCallback(&dwNotificationFlags);
+        request->GetCompletionRoutine() = false;
+    }
+    else
+        request->GetCompletionRoutine() = true;
+
+    request->SetCallback(lpfnCompletion, dwNotificationFlags);
+    return TRUE;
+}
+
 BOOLAPI
 WinHttpQueryOption
 (
@@ -3190,7 +5481,8 @@ BOOLAPI WinHttpWriteData
             request->GetReadDataEventCounter()++;
         }
 
-        ComContainer::GetInstance().ResumeTransfer(request->GetCurl(), CURLPAUSE_CONT);
+        if (request->GetEngine())
+            request->GetEngine()->ResumeTransfer(srequest, CURLPAUSE_SEND);
     }
     else
     {
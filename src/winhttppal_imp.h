@@ -19,6 +19,11 @@ extern "C"
 #include <curl/curlver.h>
 }
 
+// curl older than 7.88 caps CURLOPT_BUFFERSIZE at 512KB without exporting it
+#ifndef CURL_MAX_READ_SIZE
+#define CURL_MAX_READ_SIZE 524288
+#endif
+
 #ifdef WIN32
 #define THREAD_ID                               GetCurrentThreadId()
 #define THREADPARAM                             LPVOID
@@ -50,7 +55,32 @@ static inline THREAD_HANDLE CREATETHREAD(LPTHREAD_START_ROUTINE func, LPVOID par
 }
 #endif
 
+enum
+{
+    WINHTTP_THREAD_ENGINE,
+    WINHTTP_THREAD_CALLBACK,
+    WINHTTP_THREAD_UPLOAD,
+    WINHTTP_THREAD_SINK,
+    WINHTTP_THREAD_KINDS,
+};
+
+// CREATETHREAD plus the name, cpus, priority and stack size configured for this kind of thread
+BOOL CreateWinHttpThread(THREAD_HANDLE &thread, LPTHREAD_START_ROUTINE func, LPVOID param, int kind, int index);
+
+// WINHTTP_RECEIVE_BUFFER_SIZE_ADAPTIVE, shared by a session and its requests in flight so the engine
+// can feed it on completion without touching the session
+class ReceiveBufferSizer
+{
+    std::atomic<uint64_t> m_AverageBody{0};
+
+public:
+    void Record(uint64_t bodySize);
+    long Pick(size_t responseBufferLimit) const;
+};
+
 class WinHttpSessionImp;
+class ComContainer;
+struct ActiveTransfer;
 
 class WinHttpBase
 {
@@ -74,9 +104,26 @@ class WinHttpSessionImp :public WinHttpBase
 
     bool m_closing = false;
     DWORD m_MaxConnections = 0;
+    DWORD m_MaxResponseBufferSize = 0;
+    DWORD m_ReceiveBufferSize = 0;
+    std::shared_ptr<ReceiveBufferSizer> m_ReceiveBufferSizer = std::make_shared<ReceiveBufferSizer>();
+
+    // identifies the session to the engines, unlike its address it is never reused
+    uint64_t m_Serial = NewSerial();
+    static uint64_t NewSerial()
+    {
+        static std::atomic<uint64_t> next{0};
+        return ++next;
+    }
     DWORD m_SecureProtocol = 0;
     void *m_UserBuffer = NULL;
 
+    // engine driven by the caller's event loop, NULL when the session uses the shared engines
+    ComContainer *m_Engine = NULL;
+
+    // WINHTTP_OPTION_INLINE_CALLBACKS, deliver status callbacks on the engine thread
+    bool m_InlineCallbacks = false;
+
 public:
 
     BOOL SetUserData(void **data)
@@ -89,6 +136,19 @@ public:
     }
     void *GetUserData() { return m_UserBuffer; }
 
+    BOOL SetInlineCallbacks(DWORD *data)
+    {
+        if (!data)
+            return FALSE;
+
+        m_InlineCallbacks = (*data != 0);
+        return TRUE;
+    }
+    bool GetInlineCallbacks() const { return m_InlineCallbacks; }
+
+    BOOL SetEventLoopCallbacks(WINHTTP_EVENT_LOOP_CALLBACKS *callbacks);
+    ComContainer *GetEngine() const { return m_Engine; }
+
     BOOL SetSecureProtocol(DWORD *data)
     {
         if (!data)
@@ -108,6 +168,28 @@ public:
         return TRUE;
     }
     DWORD GetMaxConnections() const { return m_MaxConnections; }
+    uint64_t GetSerial() const { return m_Serial; }
+
+    BOOL SetMaxResponseBufferSize(DWORD *data)
+    {
+        if (!data)
+            return FALSE;
+
+        m_MaxResponseBufferSize = *data;
+        return TRUE;
+    }
+    DWORD GetMaxResponseBufferSize() const { return m_MaxResponseBufferSize; }
+
+    BOOL SetReceiveBufferSize(DWORD *data)
+    {
+        if (!data || ((*data > CURL_MAX_READ_SIZE) && (*data != WINHTTP_RECEIVE_BUFFER_SIZE_ADAPTIVE)))
+            return FALSE;
+
+        m_ReceiveBufferSize = *data;
+        return TRUE;
+    }
+    DWORD GetReceiveBufferSize() const { return m_ReceiveBufferSize; }
+    std::shared_ptr<ReceiveBufferSizer> &GetReceiveBufferSizer() { return m_ReceiveBufferSizer; }
 
     void SetAsync() { m_Async = TRUE; }
     BOOL GetAsync() const { return m_Async; }
@@ -173,26 +255,76 @@ struct BufferRequest
     size_t  m_Used = 0;
 };
 
+// FIFO byte queue over fixed-size blocks, consuming from the front only advances an offset and
+// emptied blocks are kept for the next appends
+class ChunkBuffer
+{
+    static const size_t BLOCK_SIZE = 16384;
+    static const size_t MAX_SPARE_BLOCKS = 4;
+
+    struct Block
+    {
+        size_t m_Begin = 0;
+        size_t m_End = 0;
+        BYTE m_Data[BLOCK_SIZE];
+    };
+
+    std::deque<std::unique_ptr<Block>> m_Blocks;
+    std::vector<std::unique_ptr<Block>> m_Spare;
+    size_t m_Size = 0;
+
+    // front bytes handed out by borrow(), nothing may consume them until release()
+    bool m_Lent = false;
+    size_t m_LentLength = 0;
+
+    void Recycle(std::unique_ptr<Block> block);
+
+public:
+    size_t size() const { return m_Size; }
+    bool empty() const { return m_Size == 0; }
+
+    void append(const void *data, size_t len);
+
+    // copies up to len bytes out and consumes them
+    size_t read(void *dest, size_t len);
+
+    // contiguous bytes at the front, valid until the next non-const call
+    size_t peek(const void **data) const;
+    void consume(size_t len);
+    void clear();
+
+    // peek that stays valid across appends until release() consumes len of it
+    size_t borrow(const void **data);
+    bool release(size_t len);
+    bool lent() const { return m_Lent; }
+};
+
 class WinHttpRequestImp :public WinHttpBase, public std::enable_shared_from_this<WinHttpRequestImp>
 {
     CURL *m_curl = NULL;
-    std::vector<BYTE> m_ResponseString;
+    ChunkBuffer m_ResponseBuffer;
     std::string m_HeaderString;
     std::string m_Header;
     std::string m_FullPath;
     std::string m_OptionalData;
     size_t m_TotalSize = 0;
     size_t m_TotalReceiveSize = 0;
-    std::vector<BYTE> m_ReadData;
+    ChunkBuffer m_ReadData;
 
     std::mutex m_ReadDataEventMtx;
     DWORD m_ReadDataEventCounter = 0;
 
     THREAD_HANDLE m_UploadCallbackThread;
+    bool m_HasUploadThread = false;
     bool m_UploadThreadExitStatus = false;
 
     DWORD m_SecureProtocol = 0;
     DWORD m_MaxConnections = 0;
+    DWORD m_MaxResponseBufferSize = 0;
+    DWORD m_ReceiveBufferSize = 0;
+
+    // the session's, set on send when the receive buffer size is adaptive
+    std::shared_ptr<ReceiveBufferSizer> m_ReceiveBufferSizer;
 
     std::string m_Type;
     LPVOID m_UserBuffer = NULL;
@@ -231,7 +363,67 @@ class WinHttpRequestImp :public WinHttpBase, public std::enable_shared_from_this
     std::vector<BufferRequest> m_OutstandingReads;
     bool m_Secure = false;
 
+    // engine shard running the async transfer, picked on every WinHttpSendRequest
+    ComContainer *m_Engine = NULL;
+    size_t m_HostHash = 0;
+
+    // MAX_CONNS_PER_SERVER resolved from the request or its session, enforced by the engine per session and host
+    DWORD m_HostConnectionLimit = 0;
+    uint64_t m_SessionSerial = 0;
+
+    // copied from the session on send, notifications go through m_Engine instead of the workers
+    bool m_InlineCallbacks = false;
+
+    // set by WinHttpSetCompletionRoutine, forces inline delivery for this request alone
+    bool m_CompletionRoutine = false;
+
+    // flow control, notifications queued but not yet dispatched and whether WriteBodyFunction paused the transfer
+    std::atomic<long> m_PendingNotifications{0};
+    size_t m_ResponseBufferLimit = 0;
+    std::atomic<bool> m_WritePaused{false};
+
+    // the engine's entry while the transfer is attached, its reference is borrowed by the curl callbacks on the engine thread
+    ActiveTransfer *m_TransferPin = NULL;
+
+    // WINHTTP_OPTION_RESPONSE_SINK_*, m_SinkOwned when the library opened it from a path
+    int m_SinkFd = -1;
+    bool m_SinkOwned = false;
+    uint64_t m_SinkWritten = 0;
+    int m_SinkError = 0;
+
+    // async sinks are written by a SinkWriter thread from m_ResponseBuffer, these are under GetBodyStringMutex.
+    // m_SinkQueued while the writer owns the request, m_SinkDone when the transfer ended before it drained.
+    bool m_SinkQueued = false;
+    bool m_SinkDone = false;
+    CURLcode m_SinkCode = CURLE_OK;
+
 public:
+    ComContainer *GetEngine() { return m_Engine; }
+    void SetEngine(ComContainer *engine);
+    void SetTransferPin(ActiveTransfer *pin) { m_TransferPin = pin; }
+    void NotePaused(int bitmask);
+
+    int GetSinkFd() const { return m_SinkFd; }
+    void SetSink(int fd, bool owned);
+    bool WriteToSink(const void *data, size_t len, int &error);
+    size_t QueueToSink(std::shared_ptr<WinHttpRequestImp> &srequest, const void *data, size_t len);
+    void DrainSink(std::shared_ptr<WinHttpRequestImp> &srequest);
+    void FinishSink(std::shared_ptr<WinHttpRequestImp> &srequest, CURLcode code);
+    void CompleteSink(std::shared_ptr<WinHttpRequestImp> &srequest, CURLcode code);
+    std::shared_ptr<WinHttpRequestImp> &PinnedRef(std::shared_ptr<WinHttpRequestImp> &fallback);
+    size_t &GetHostHash() { return m_HostHash; }
+    DWORD &GetHostConnectionLimit() { return m_HostConnectionLimit; }
+    uint64_t &GetSessionSerial() { return m_SessionSerial; }
+    bool &GetInlineCallbacks() { return m_InlineCallbacks; }
+    bool &GetCompletionRoutine() { return m_CompletionRoutine; }
+
+    std::atomic<long> &GetPendingNotifications() { return m_PendingNotifications; }
+    size_t &GetResponseBufferLimit() { return m_ResponseBufferLimit; }
+    bool FlowControlExceeded(bool draining);
+    bool PauseForFlowControl();
+    void ResumeIfDrained(std::shared_ptr<WinHttpRequestImp> &srequest, bool force);
+    void ResumeAll(std::shared_ptr<WinHttpRequestImp> &srequest);
+
     bool &GetSecure() { return m_Secure; }
     std::vector<BufferRequest> &GetOutstandingWrites() { return m_OutstandingWrites; }
     std::vector<BufferRequest> &GetOutstandingReads() { return m_OutstandingReads; }
@@ -242,6 +434,7 @@ public:
     static size_t WriteHeaderFunction(void *ptr, size_t size, size_t nmemb, void* rqst);
     static size_t WriteBodyFunction(void *ptr, size_t size, size_t nmemb, void* rqst);
     void ConsumeIncoming(std::shared_ptr<WinHttpRequestImp> &srequest, void* &ptr, size_t &available, size_t &read);
+    size_t ConsumeBuffered(std::shared_ptr<WinHttpRequestImp> &srequest);
     void FlushIncoming(std::shared_ptr<WinHttpRequestImp> &srequest);
     void SetCallback(WINHTTP_STATUS_CALLBACK lpfnInternetCallback, DWORD dwNotificationFlags) {
         m_InternetCallback = lpfnInternetCallback;
@@ -272,7 +465,7 @@ public:
     bool &GetCompletionStatus() { return m_Completion; }
     bool &GetClosing() { return m_closing; }
     bool &GetClosed() { return m_closed; }
-    void CleanUp();
+    bool CleanUp();
     ~WinHttpRequestImp();
 
     bool &GetUploadThreadExitStatus() { return m_UploadThreadExitStatus; }
@@ -281,6 +474,7 @@ public:
     THREAD_HANDLE &GetUploadThread() {
         return m_UploadCallbackThread;
     }
+    bool &HasUploadThread() { return m_HasUploadThread; }
 
     static THREADRETURN UploadThreadFunction(THREADPARAM lpThreadParameter);
 
@@ -333,6 +527,29 @@ public:
     }
     DWORD GetMaxConnections() { return m_MaxConnections; }
 
+    BOOL SetMaxResponseBufferSize(DWORD *data)
+    {
+        if (!data)
+            return FALSE;
+
+        m_MaxResponseBufferSize = *data;
+        return TRUE;
+    }
+    DWORD GetMaxResponseBufferSize() { return m_MaxResponseBufferSize; }
+
+    BOOL SetReceiveBufferSize(DWORD *data)
+    {
+        if (!data || ((*data > CURL_MAX_READ_SIZE) && (*data != WINHTTP_RECEIVE_BUFFER_SIZE_ADAPTIVE)))
+            return FALSE;
+
+        m_ReceiveBufferSize = *data;
+        return TRUE;
+    }
+    DWORD GetReceiveBufferSize() { return m_ReceiveBufferSize; }
+    std::shared_ptr<ReceiveBufferSizer> &GetReceiveBufferSizer() { return m_ReceiveBufferSizer; }
+    // feeds the body size of a finished transfer to the adaptive receive buffer sizing
+    void RecordReceivedBody();
+
     BOOL SetUserData(void **data)
     {
         if (!data)
@@ -371,7 +588,7 @@ public:
         }
     }
 
-    std::vector<BYTE> &GetResponseString() { return m_ResponseString; }
+    ChunkBuffer &GetResponseBuffer() { return m_ResponseBuffer; }
     std::string &GetHeaderString() { return m_HeaderString; }
     CURL *GetCurl() { return m_curl; }
 
@@ -391,12 +608,12 @@ public:
         return TRUE;
     }
 
-    std::vector<BYTE> &GetReadData() { return m_ReadData; }
+    ChunkBuffer &GetReadData() { return m_ReadData; }
 
     void AppendReadData(const void *data, size_t len)
     {
         std::lock_guard<std::mutex> lck(GetReadDataEventMtx());
-        m_ReadData.insert(m_ReadData.end(), static_cast<const BYTE*>(data), static_cast<const BYTE*>(data) + len);
+        m_ReadData.append(data, len);
     }
 
     static int SocketCallback(CURL *handle, curl_infotype type,
@@ -406,6 +623,10 @@ public:
     static size_t ReadCallback(void *ptr, size_t size, size_t nmemb, void *userp);
 };
 
+#ifndef WINHTTP_INLINE_STATUS_SIZE
+#define WINHTTP_INLINE_STATUS_SIZE 32
+#endif
+
 class UserCallbackContext
 {
     typedef void (*CompletionCb)(std::shared_ptr<WinHttpRequestImp> &, DWORD status);
@@ -419,11 +640,24 @@ class UserCallbackContext
     LPVOID m_StatusInformationVal = NULL;
     BYTE* m_StatusInformation = NULL;
     bool m_allocate = FALSE;
+
+    // small copied payloads (DWORD, WINHTTP_ASYNC_RESULT) live here instead of m_StatusInformation
+    alignas(8) BYTE m_InlineStatus[WINHTTP_INLINE_STATUS_SIZE];
     BOOL m_AsyncResultValid = false;
     CompletionCb m_requestCompletionCb;
 
+    // link in the dispatcher queue, owned by UserCallbackWorker
+    UserCallbackContext *m_QueueNext = NULL;
+
+    // when the notification was raised, for the queue wait histogram
+    std::chrono::steady_clock::time_point m_Queued;
+
     BOOL SetAsyncResult(LPVOID statusInformation, DWORD statusInformationCopySize, bool allocate) {
-        if (allocate)
+        if (allocate && (statusInformationCopySize <= sizeof(m_InlineStatus)))
+        {
+            memcpy(m_InlineStatus, statusInformation, statusInformationCopySize);
+        }
+        else if (allocate)
         {
             m_StatusInformation = new BYTE[statusInformationCopySize];
             if (m_StatusInformation)
@@ -456,7 +690,7 @@ public:
         : m_request(request), m_dwInternetStatus(dwInternetStatus),
         m_dwStatusInformationLength(dwStatusInformationLength),
         m_dwNotificationFlags(dwNotificationFlags), m_cb(cb), m_userdata(userdata),
-        m_requestCompletionCb(completion)
+        m_requestCompletionCb(completion), m_Queued(std::chrono::steady_clock::now())
     {
         if (statusInformation)
             SetAsyncResult(statusInformation, statusInformationCopySize, allocate);
@@ -466,7 +700,11 @@ public:
     {
         delete [] m_StatusInformation;
     }
-    
+
+    // contexts are recycled through per-thread magazines, see ContextCache
+    static void *operator new(size_t size);
+    static void operator delete(void *ptr, size_t size);
+
     std::shared_ptr<WinHttpRequestImp> &GetRequestRef() { return m_request; }
     WinHttpRequestImp *GetRequest() { return m_request.get(); }
     DWORD GetInternetStatus() const { return m_dwInternetStatus; }
@@ -477,11 +715,13 @@ public:
     LPVOID GetUserdata() { return m_userdata; }
     LPVOID GetStatusInformation() {
         if (m_allocate)
-            return m_StatusInformation;
+            return m_StatusInformation ? m_StatusInformation : m_InlineStatus;
         else
             return m_StatusInformationVal;
     }
     BOOL GetStatusInformationValid() const { return m_AsyncResultValid; }
+    UserCallbackContext *&GetQueueNext() { return m_QueueNext; }
+    std::chrono::steady_clock::time_point GetQueued() const { return m_Queued; }
 
 private:
     UserCallbackContext(const UserCallbackContext&);
@@ -507,31 +747,40 @@ public:
 };
 
 
-class UserCallbackContainer
+// one dispatcher thread, a request always lands on the same worker so its callbacks stay in order
+class UserCallbackWorker
 {
-    typedef std::vector<UserCallbackContext*> UserCallbackQueue;
+    int m_Index = 0;
 
-    UserCallbackQueue m_Queue;
+    // lock-free LIFO filled by any thread, the worker takes the whole list at once
+    std::atomic<UserCallbackContext *> m_Incoming;
 
-    // used to protect GetCallbackMap()
-    std::mutex m_MapMutex;
+    // contexts taken from m_Incoming in submission order, touched by the worker thread only
+    UserCallbackContext *m_Pending = NULL;
 
     THREAD_HANDLE m_hThread;
+    bool m_HasThread = false;
 
-    // used by UserCallbackThreadFunction as a wake-up signal
-    std::mutex m_hEventMtx;
-    std::condition_variable m_hEvent;
+    // bumped on every enqueue, the worker sleeps on it (futex on Linux) while both queues are empty
+    std::atomic<uint32_t> m_Signal;
 
-    // cleared by UserCallbackThreadFunction, set by multiple event providers
-    std::atomic<DWORD> m_EventCounter;
+    // set while the worker is parked, producers skip the wake-up call otherwise
+    std::atomic<bool> m_Sleeping;
+#ifndef __linux__
+    std::mutex m_SignalMtx;
+    std::condition_variable m_SignalCv;
+#endif
 
-    bool m_closing = false;
-    UserCallbackQueue &GetCallbackQueue() { return m_Queue; }
+    std::atomic<bool> m_closing;
 
+    void Signal();
+    void WaitForSignal(uint32_t seen);
 
 public:
 
     bool GetClosing() const { return m_closing; }
+    int GetIndex() const { return m_Index; }
+    bool IsRunning() const { return m_HasThread; }
 
     UserCallbackContext* GetNext();
 
@@ -540,76 +789,294 @@ public:
     BOOL Queue(UserCallbackContext *ctx);
     void DrainQueue();
 
-    UserCallbackContainer(): m_EventCounter(0)
+    explicit UserCallbackWorker(int index): m_Index(index), m_Incoming(NULL), m_Signal(0), m_Sleeping(false), m_closing(false)
     {
-        DWORD thread_id;
-        m_hThread = CREATETHREAD(
+        m_HasThread = CreateWinHttpThread(m_hThread,
             UserCallbackThreadFunction,       // thread function name
             this,          // argument to thread function
-            &thread_id
+            WINHTTP_THREAD_CALLBACK, m_Index
         );
     }
 
-    ~UserCallbackContainer()
+    ~UserCallbackWorker()
     {
         m_closing = true;
-        {
-            std::lock_guard<std::mutex> lck(m_hEventMtx);
-            m_EventCounter++;
-            m_hEvent.notify_all();
-        }
-        THREADJOIN(m_hThread);
+        Signal();
+        if (m_HasThread)
+            THREADJOIN(m_hThread);
         DrainQueue();
     }
 
+private:
+    UserCallbackWorker(const UserCallbackWorker&);
+    UserCallbackWorker& operator=(const UserCallbackWorker&);
+};
+
+class UserCallbackContainer
+{
+    std::vector<std::unique_ptr<UserCallbackWorker>> m_Workers;
+
+public:
+
+    BOOL Queue(UserCallbackContext *ctx);
+    UserCallbackWorker &GetWorker(WinHttpRequestImp *request);
+    static void Dispatch(UserCallbackContext *ctx);
+    static void Discard(UserCallbackContext *ctx);
+
+    UserCallbackContainer();
+
     static UserCallbackContainer &GetInstance()
     {
-        static UserCallbackContainer the_instance;
-        return the_instance;
+        // leaked like the engines, which may still queue HANDLE_CLOSING while statics are torn down at exit
+        static UserCallbackContainer *the_instance = new UserCallbackContainer();
+        return *the_instance;
     }
 private:
     UserCallbackContainer(const UserCallbackContainer&);
     UserCallbackContainer& operator=(const UserCallbackContainer&);
 };
 
+// threads writing async response sinks, so a slow disk or pipe never blocks an engine
+class SinkWriter
+{
+    std::mutex m_Mtx;
+    std::condition_variable m_Cv;
+    std::deque<std::shared_ptr<WinHttpRequestImp>> m_Jobs;
+    std::vector<THREAD_HANDLE> m_Threads;
+
+    static THREADRETURN SinkThreadFunction(LPVOID lpThreadParameter);
+
+public:
+
+    BOOL Queue(const std::shared_ptr<WinHttpRequestImp> &srequest);
+
+    SinkWriter();
+
+    static SinkWriter &GetInstance()
+    {
+        // leaked, the threads run until exit
+        static SinkWriter *the_instance = new SinkWriter();
+        return *the_instance;
+    }
+private:
+    SinkWriter(const SinkWriter&);
+    SinkWriter& operator=(const SinkWriter&);
+};
+
+// process-wide callback latency histograms, indexed by the bit number of the status
+class CallbackStats
+{
+    static const int STATUS_SLOTS = 32;
+
+    struct Histograms
+    {
+        std::atomic<uint64_t> m_Dispatched{0};
+        std::atomic<uint64_t> m_Discarded{0};
+        std::atomic<uint64_t> m_Wait[WINHTTP_CALLBACK_STATS_BUCKETS];
+        std::atomic<uint64_t> m_Run[WINHTTP_CALLBACK_STATS_BUCKETS];
+    };
+
+    Histograms m_Status[STATUS_SLOTS];
+    std::atomic<int64_t> m_Depth{0};
+    std::atomic<int64_t> m_MaxDepth{0};
+
+public:
+    CallbackStats();
+
+    static CallbackStats &Instance();
+
+    void Raised();
+    void Discarded(DWORD dwInternetStatus);
+    void Dispatched(DWORD dwInternetStatus, std::chrono::steady_clock::duration wait, std::chrono::steady_clock::duration run);
+    BOOL Query(WINHTTP_CALLBACK_STATS *pStats);
+};
+
+// Opened by an engine around each round of work. Notifications of its inline-callback requests
+// raised inside are collected and delivered when the outermost scope closes, so callbacks never
+// run under a library lock or from inside a libcurl callback.
+class InlineCallbackScope
+{
+public:
+    explicit InlineCallbackScope(ComContainer *engine);
+    ~InlineCallbackScope();
+
+    static bool Active(ComContainer *engine);
+    static void Defer(UserCallbackContext *ctx);
+
+private:
+    InlineCallbackScope(const InlineCallbackScope&);
+    InlineCallbackScope& operator=(const InlineCallbackScope&);
+};
+
 class EnvInit
 {
 public:
     EnvInit();
 };
 
+enum
+{
+    ENGINE_COMMAND_ADD,
+    ENGINE_COMMAND_RESUME,
+    ENGINE_COMMAND_NOTIFY,
+    ENGINE_COMMAND_CANCEL,
+};
+
+// posted by application threads, executed by the engine thread that owns the multi handle
+struct EngineCommand
+{
+    int m_Type = ENGINE_COMMAND_ADD;
+    std::shared_ptr<WinHttpRequestImp> m_Request;
+    int m_Bitmask = 0;
+    UserCallbackContext *m_Context = NULL;
+    EngineCommand *m_Next = NULL;
+};
+
+// per-transfer bookkeeping of an engine, keyed by the easy handle
+struct ActiveTransfer
+{
+    std::shared_ptr<WinHttpRequestImp> m_Request;
+
+    // directions paused by the curl callbacks or curl_easy_pause(), lets the engine skip redundant resumes
+    int m_PauseBitmask = CURLPAUSE_CONT;
+    std::chrono::steady_clock::time_point m_Started;
+
+    // counted against a WINHTTP_OPTION_MAX_CONNS_PER_SERVER cap
+    bool m_Admitted = false;
+};
+
+// session serial and host hash
+typedef std::pair<uint64_t, size_t> AdmissionKey;
+
+// transfers of one session and host under WINHTTP_OPTION_MAX_CONNS_PER_SERVER, the ones over the cap wait here
+struct HostAdmission
+{
+    DWORD m_Active = 0;
+    std::deque<std::shared_ptr<WinHttpRequestImp>> m_Pending;
+};
+
+enum
+{
+    WINHTTP_ENGINE_POLICY_HOST_HASH,
+    WINHTTP_ENGINE_POLICY_LEAST_LOADED,
+};
+
 class ComContainer
 {
+    int m_Index = 0;
+
+    // transfers submitted and not yet removed, waiting ones included, used by the least-loaded shard policy
+    std::atomic<int> m_Load;
+
     THREAD_HANDLE m_hAsyncThread;
-    std::mutex m_hAsyncEventMtx;
+    bool m_HasThread = false;
 
-    // used to wake up the Async Thread
-    // Set by external components, cleared by the Async thread
-    std::atomic<DWORD> m_hAsyncEventCounter;
-    std::condition_variable m_hAsyncEvent;
-    std::mutex m_MultiMutex;
+    // m_curlm and everything below is owned by the engine thread, other threads go through PostCommand
     CURLM *m_curlm = NULL;
-    std::vector< CURL *> m_ActiveCurl;
-    std::vector<std::shared_ptr<WinHttpRequestImp>> m_ActiveRequests;
+    std::unordered_map<CURL *, ActiveTransfer> m_Transfers;
     BOOL m_closing = FALSE;
 
-    // used to protect CURLM data structures
+#ifdef __linux__
+    // epoll set holding the sockets libcurl asked us to watch
+    int m_epollfd = -1;
+
+    // armed to m_TimerDeadline with nanosecond resolution, so epoll_wait never has to round to ms
+    int m_TimerFd = -1;
+#else
+    // socket -> CURL_POLL_* interest, turned into a pollfd array on every wait
+    std::map<curl_socket_t, int> m_Sockets;
+#endif
+
+    // deadline requested by CURLMOPT_TIMERFUNCTION, only valid when m_TimerArmed is set
+    std::chrono::steady_clock::time_point m_TimerDeadline;
+    bool m_TimerArmed = false;
+    int m_RunningHandles = 0;
+
+    // per session and host caps, the multi handle itself only carries the process wide WINHTTP_PAL_* ones
+    std::map<AdmissionKey, HostAdmission> m_Admissions;
+
+    // lock-free LIFO of pending commands, the engine thread takes the whole list at once
+    std::atomic<EngineCommand *> m_Commands;
+
+    // used to wake up the Async Thread
+    // readable end is watched next to the curl sockets, written by KickStart to interrupt the wait
+    int m_WakeReadFd = -1;
+    int m_WakeWriteFd = -1;
+
+    // set by KickStart, cleared by the Async thread, so a burst of kicks costs a single write
+    std::atomic<bool> m_WakePending;
+
+    // when set there is no engine thread, the caller's loop watches the sockets and the timer
+    bool m_ExternalLoop = false;
+    WINHTTP_EVENT_LOOP_CALLBACKS m_External;
+
+    // an external loop engine is shared by its session and the requests sent on it. The last Release
+    // deletes it, or the host's way out of ProcessSocket/ProcessTimeout when it happens inside one.
+    std::mutex m_LifetimeMtx;
+    long m_Refs = 1;
+    int m_Calls = 0;
+    bool m_DetachPending = false;
+    bool m_DeletePending = false;
+
+    // the session is gone and nothing drives the engine anymore, commands are disposed of as they are posted
+    std::atomic<bool> m_Detached{false};
+
     BOOL GetThreadClosing() const { return m_closing; }
 
+    static int SocketCallback(CURL *easy, curl_socket_t s, int what, void *userp, void *socketp);
+    static int TimerCallback(CURLM *multi, long timeout_ms, void *userp);
+    long GetWaitTimeoutMs();
+    void ArmTimer();
+    void SocketAction(curl_socket_t s, int evBitmask);
+
+    void PostCommand(EngineCommand *cmd);
+    void PostCommands(EngineCommand *first, EngineCommand *last);
+    void ProcessCommands();
+    static void DiscardCommands(EngineCommand *cmd);
+    void EnterCall();
+    bool LeaveCall();
+    void AbandonTransfers();
+    BOOL HandleSocket(int fd, DWORD dwEvents);
+    BOOL HandleTimeout();
+    void AttachHandle(std::shared_ptr<WinHttpRequestImp> &srequest);
+    bool Admit(std::shared_ptr<WinHttpRequestImp> &srequest);
+    void ReleaseAdmission(const AdmissionKey &key);
+    void DropPending(std::shared_ptr<WinHttpRequestImp> &srequest);
+    void DrainWakeup();
+    void ReadCompletions();
+
 public:
-    CURL *AllocCURL();
-    void FreeCURL(CURL *ptr);
+    static void GlobalInit();
+    static CURL *AllocCURL();
+    static void FreeCURL(CURL *ptr);
+    static std::vector<ComContainer *> &GetShards();
     static ComContainer &GetInstance();
-    void ResumeTransfer(CURL *handle, int bitmask);
-    BOOL AddHandle(std::shared_ptr<WinHttpRequestImp> &srequest, CURL *handle);
-    BOOL RemoveHandle(std::shared_ptr<WinHttpRequestImp> &srequest, CURL *handle, bool clearPrivate);
+    static ComContainer &GetInstance(size_t hostHash, bool byHost = false);
+    int GetIndex() const { return m_Index; }
+    int GetLoad() const { return m_Load; }
+    // an external loop engine runs on the app's thread
+    bool IsRunning() const { return m_ExternalLoop || m_HasThread; }
+    // a transfer about to be handed to AddHandle(s), released by RemoveHandle
+    void Reserve() { m_Load++; }
+    // bitmask holds the CURLPAUSE_RECV and/or CURLPAUSE_SEND directions to resume, the others stay paused
+    void ResumeTransfer(std::shared_ptr<WinHttpRequestImp> &srequest, int bitmask);
+    void PostNotification(UserCallbackContext *ctx);
+    void CancelPending(std::shared_ptr<WinHttpRequestImp> &srequest);
+    BOOL AddHandle(std::shared_ptr<WinHttpRequestImp> &srequest);
+    BOOL AddHandles(std::vector<std::shared_ptr<WinHttpRequestImp>> &requests);
+    BOOL RemoveHandle(CURL *handle, bool clearPrivate);
     void KickStart();
-    ComContainer();
+    void AddRef();
+    void Release();
+    void Detach();
+    explicit ComContainer(int index, const WINHTTP_EVENT_LOOP_CALLBACKS *external = NULL);
     ~ComContainer();
 
     static THREADRETURN AsyncThreadFunction(THREADPARAM lpThreadParameter);
 
     int QueryData(int *still_running);
+    BOOL ProcessSocket(int fd, DWORD dwEvents);
+    BOOL ProcessTimeout();
 private:
     ComContainer(const ComContainer&);
     ComContainer& operator=(const ComContainer&);
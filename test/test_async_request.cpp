@@ -0,0 +1,138 @@
+/***
+ * Copyright (C) Microsoft. All rights reserved.
+ * Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+ *
+ * =+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+
+ *
+ * HTTP Library: winhttppal::AsyncRequest futures.
+ *
+ * =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+ ****/
+#include "test_common.h"
+#include "winhttppal_async.h"
+
+#include <type_traits>
+
+using winhttppal::AsyncRequest;
+using winhttppal::AsyncResult;
+
+static_assert(!std::is_copy_constructible<AsyncRequest>::value, "AsyncRequest owns its handle");
+static_assert(!std::is_copy_assignable<AsyncRequest>::value, "AsyncRequest owns its handle");
+static_assert(std::is_nothrow_move_constructible<AsyncRequest>::value, "");
+static_assert(std::is_nothrow_move_assignable<AsyncRequest>::value, "");
+
+static std::string ReadBody(AsyncRequest &request)
+{
+    std::string body;
+    std::vector<char> buffer;
+
+    while (true)
+    {
+        AsyncResult result = request.QueryDataAvailableAsync().get();
+        CHECK(result.Succeeded());
+        if (!result.dwLength)
+            break;
+
+        buffer.resize(result.dwLength);
+        result = request.ReadDataAsync(buffer.data(), static_cast<DWORD>(buffer.size())).get();
+        CHECK(result.Succeeded());
+        body.append(buffer.data(), result.dwLength);
+    }
+    return body;
+}
+
+static void TestGet(HINTERNET connect)
+{
+    AsyncRequest request(WinHttpOpenRequest(connect, "GET", "/bytes/250000", NULL, NULL, NULL, 0));
+
+    CHECK(request.GetHandle());
+    CHECK(request.SendRequestAsync().get().Succeeded());
+    CHECK(request.ReceiveResponseAsync().get().Succeeded());
+    CHECK(ReadBody(request) == test::ExpectedBody(250000));
+}
+
+static void TestUpload(HINTERNET connect)
+{
+    static const DWORD TOTAL = 200000;
+    static const DWORD CHUNK = 65536;
+    std::string payload = test::ExpectedBody(TOTAL);
+    AsyncRequest request(WinHttpOpenRequest(connect, "PUT", "/upload", NULL, NULL, NULL, 0));
+
+    CHECK(request.SendRequestAsync(NULL, 0, TOTAL).get().Succeeded());
+    for (DWORD sent = 0; sent < TOTAL; )
+    {
+        DWORD length = std::min(CHUNK, TOTAL - sent);
+        AsyncResult result = request.WriteDataAsync(payload.data() + sent, length).get();
+
+        CHECK(result.Succeeded());
+        CHECK(result.dwLength == length);
+        sent += length;
+    }
+    CHECK(request.ReceiveResponseAsync().get().Succeeded());
+    CHECK(ReadBody(request) == std::to_string(TOTAL));
+}
+
+static void TestMove(HINTERNET connect)
+{
+    AsyncRequest first(WinHttpOpenRequest(connect, "GET", "/bytes/1000", NULL, NULL, NULL, 0));
+    HINTERNET handle = first.GetHandle();
+
+    AsyncRequest second(std::move(first));
+    CHECK(second.GetHandle() == handle);
+    CHECK(first.GetHandle() == NULL);
+
+    // nothing to issue on once moved from
+    AsyncResult result = first.SendRequestAsync().get();
+    CHECK(result.dwError == ERROR_WINHTTP_INCORRECT_HANDLE_STATE);
+
+    // assignment closes the handle it replaces
+    AsyncRequest third(WinHttpOpenRequest(connect, "GET", "/bytes/2000", NULL, NULL, NULL, 0));
+    third = std::move(second);
+    CHECK(third.GetHandle() == handle);
+
+    CHECK(third.SendRequestAsync().get().Succeeded());
+    CHECK(third.ReceiveResponseAsync().get().Succeeded());
+    CHECK(ReadBody(third) == test::ExpectedBody(1000));
+}
+
+static void TestFailure(INTERNET_PORT port)
+{
+    HINTERNET session = WinHttpOpen("test", 0, NULL, NULL, WINHTTP_FLAG_ASYNC);
+    HINTERNET connect = WinHttpConnect(session, "127.0.0.1", port, 0);
+
+    // nothing listens there any more, the engine reports the error to whichever operation is in flight
+    {
+        AsyncRequest request(WinHttpOpenRequest(connect, "GET", "/bytes/10", NULL, NULL, NULL, 0));
+        AsyncResult result = request.SendRequestAsync().get();
+
+        if (result.Succeeded())
+            result = request.ReceiveResponseAsync().get();
+        CHECK(!result.Succeeded());
+    }
+
+    WinHttpCloseHandle(connect);
+    WinHttpCloseHandle(session);
+}
+
+int main()
+{
+    INTERNET_PORT closedPort;
+
+    {
+        test::LoopbackServer server;
+        HINTERNET session = WinHttpOpen("test", 0, NULL, NULL, WINHTTP_FLAG_ASYNC);
+        HINTERNET connect = WinHttpConnect(session, "127.0.0.1", server.GetPort(), 0);
+        CHECK(connect);
+
+        TestGet(connect);
+        TestUpload(connect);
+        TestMove(connect);
+
+        WinHttpCloseHandle(connect);
+        WinHttpCloseHandle(session);
+        closedPort = server.GetPort();
+    }
+
+    TestFailure(closedPort);
+    return 0;
+}
@@ -0,0 +1,75 @@
+/***
+ * Copyright (C) Microsoft. All rights reserved.
+ * Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+ *
+ * =+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+
+ *
+ * HTTP Library: WinHttpSendRequestBatch.
+ *
+ * =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+ ****/
+#include "test_common.h"
+
+static const DWORD REQUESTS = 8;
+
+int main()
+{
+    test::LoopbackServer server;
+    test::Transfer transfers[REQUESTS];
+    WINHTTP_SEND_REQUEST_BATCH_ITEM items[REQUESTS + 2];
+    HINTERNET requests[REQUESTS];
+
+    HINTERNET session = WinHttpOpen("test", 0, NULL, NULL, WINHTTP_FLAG_ASYNC);
+    CHECK(session);
+    WinHttpSetStatusCallback(session, test::ReadToEndCallback, WINHTTP_CALLBACK_FLAG_ALL_NOTIFICATIONS, 0);
+    HINTERNET connect = WinHttpConnect(session, "127.0.0.1", server.GetPort(), 0);
+    CHECK(connect);
+
+    HINTERNET syncSession = WinHttpOpen("test", 0, NULL, NULL, 0);
+    HINTERNET syncConnect = WinHttpConnect(syncSession, "127.0.0.1", server.GetPort(), 0);
+    HINTERNET syncRequest = WinHttpOpenRequest(syncConnect, "GET", "/bytes/1", NULL, NULL, NULL, 0);
+
+    memset(items, 0, sizeof(items));
+    for (DWORD i = 0; i < REQUESTS; i++)
+    {
+        std::string path = "/bytes/" + std::to_string(1000 * i + 1);
+
+        requests[i] = WinHttpOpenRequest(connect, "GET", path.c_str(), NULL, NULL, NULL, 0);
+        CHECK(requests[i]);
+        items[i].hRequest = requests[i];
+        items[i].dwContext = reinterpret_cast<DWORD_PTR>(&transfers[i]);
+        items[i].dwError = 0xdead;
+    }
+
+    // items that can't be sent fail on their own, the others still go out
+    items[REQUESTS].hRequest = NULL;
+    items[REQUESTS + 1].hRequest = syncRequest;
+
+    CHECK(!WinHttpSendRequestBatch(items, REQUESTS + 2));
+    CHECK(items[REQUESTS].dwError == ERROR_INVALID_PARAMETER);
+    CHECK(items[REQUESTS + 1].dwError == ERROR_INVALID_PARAMETER);
+
+    for (DWORD i = 0; i < REQUESTS; i++)
+    {
+        CHECK(items[i].dwError == ERROR_SUCCESS);
+        CHECK(transfers[i].m_Done.Wait(10000));
+        CHECK(transfers[i].m_Error == ERROR_SUCCESS);
+        CHECK(transfers[i].m_Body == test::ExpectedBody(1000 * i + 1));
+    }
+
+    // an empty batch is not an error
+    CHECK(WinHttpSendRequestBatch(NULL, 0));
+    CHECK(!WinHttpSendRequestBatch(NULL, 1));
+
+    for (DWORD i = 0; i < REQUESTS; i++)
+        WinHttpCloseHandle(requests[i]);
+    for (DWORD i = 0; i < REQUESTS; i++)
+        CHECK(test::WaitFor([&] { return transfers[i].m_Closing.load(); }, 5000));
+
+    WinHttpCloseHandle(syncRequest);
+    WinHttpCloseHandle(syncConnect);
+    WinHttpCloseHandle(syncSession);
+    WinHttpCloseHandle(connect);
+    WinHttpCloseHandle(session);
+    return 0;
+}
@@ -0,0 +1,137 @@
+/***
+ * Copyright (C) Microsoft. All rights reserved.
+ * Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+ *
+ * =+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+
+ *
+ * HTTP Library: WinHttpReadDataBorrow/WinHttpReleaseData on sync and async requests.
+ *
+ * =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+ ****/
+#include "test_common.h"
+#include "winhttppal_async.h"
+
+using winhttppal::AsyncRequest;
+using winhttppal::AsyncResult;
+
+static const size_t BODY = 300000;
+
+static void TestSync(INTERNET_PORT port)
+{
+    std::string body;
+    LPCVOID view;
+    DWORD length;
+
+    HINTERNET session = WinHttpOpen("test", 0, NULL, NULL, 0);
+    HINTERNET connect = WinHttpConnect(session, "127.0.0.1", port, 0);
+    HINTERNET request = WinHttpOpenRequest(connect, "GET", "/bytes/300000", NULL, NULL, NULL, 0);
+
+    CHECK(WinHttpSendRequest(request, NULL, 0, NULL, 0, 0, 0));
+    CHECK(WinHttpReceiveResponse(request, NULL));
+
+    while (WinHttpReadDataBorrow(request, &view, &length) && length)
+    {
+        body.append(static_cast<const char *>(view), length);
+        CHECK(WinHttpReleaseData(request, length));
+    }
+    CHECK(body == test::ExpectedBody(BODY));
+
+    WinHttpCloseHandle(request);
+    WinHttpCloseHandle(connect);
+    WinHttpCloseHandle(session);
+}
+
+static void TestAsync(HINTERNET connect)
+{
+    AsyncRequest request(WinHttpOpenRequest(connect, "GET", "/bytes/300000", NULL, NULL, NULL, 0));
+    HINTERNET handle = request.GetHandle();
+    std::string body;
+    int partial = 0;
+    bool eof = false;
+
+    AsyncResult result = request.SendRequestAsync().get();
+    CHECK(result.Succeeded());
+    CHECK(request.ReceiveResponseAsync().get().Succeeded());
+
+    while (!eof)
+    {
+        result = request.QueryDataAvailableAsync().get();
+        CHECK(result.Succeeded());
+
+        while (true)
+        {
+            LPCVOID view;
+            LPCVOID second;
+            DWORD length;
+            DWORD secondLength;
+            char byte;
+
+            if (!WinHttpReadDataBorrow(handle, &view, &length))
+            {
+                CHECK(GetLastError() == ERROR_IO_PENDING);
+                break;
+            }
+            if (!length)
+            {
+                eof = true;
+                break;
+            }
+
+            // one view at a time, and no copying reads or a re-send while it is held
+            CHECK(!WinHttpReadDataBorrow(handle, &second, &secondLength));
+            CHECK(GetLastError() == ERROR_WINHTTP_INCORRECT_HANDLE_STATE);
+            CHECK(!WinHttpReadData(handle, &byte, 1, NULL));
+            CHECK(!WinHttpReleaseData(handle, length + 1));
+
+            // consuming part of a view leaves the rest for the next borrow
+            DWORD use = ((length > 1) && (partial++ % 3 == 0)) ? length / 2 : length;
+            body.append(static_cast<const char *>(view), use);
+            CHECK(WinHttpReleaseData(handle, use));
+        }
+    }
+
+    CHECK(body == test::ExpectedBody(BODY));
+    CHECK(!WinHttpReleaseData(handle, 1));
+}
+
+// the response buffer behind a view must not be reset by sending the request again
+static void TestResendWhileLent(HINTERNET connect)
+{
+    AsyncRequest request(WinHttpOpenRequest(connect, "GET", "/bytes/300000", NULL, NULL, NULL, 0));
+    HINTERNET handle = request.GetHandle();
+    LPCVOID view;
+    DWORD length;
+
+    CHECK(request.SendRequestAsync().get().Succeeded());
+    CHECK(request.ReceiveResponseAsync().get().Succeeded());
+    CHECK(request.QueryDataAvailableAsync().get().Succeeded());
+
+    CHECK(WinHttpReadDataBorrow(handle, &view, &length));
+    CHECK(length > 0);
+    std::string before(static_cast<const char *>(view), length);
+
+    CHECK(!WinHttpSendRequest(handle, NULL, 0, NULL, 0, 0, 0));
+    CHECK(GetLastError() == ERROR_WINHTTP_INCORRECT_HANDLE_STATE);
+
+    CHECK(std::string(static_cast<const char *>(view), length) == before);
+    CHECK(before == test::ExpectedBody(BODY).substr(0, length));
+    CHECK(WinHttpReleaseData(handle, length));
+}
+
+int main()
+{
+    test::LoopbackServer server;
+
+    TestSync(server.GetPort());
+
+    HINTERNET session = WinHttpOpen("test", 0, NULL, NULL, WINHTTP_FLAG_ASYNC);
+    HINTERNET connect = WinHttpConnect(session, "127.0.0.1", server.GetPort(), 0);
+    CHECK(connect);
+
+    TestAsync(connect);
+    TestResendWhileLent(connect);
+
+    WinHttpCloseHandle(connect);
+    WinHttpCloseHandle(session);
+    return 0;
+}
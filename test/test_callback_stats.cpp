@@ -0,0 +1,90 @@
+/***
+ * Copyright (C) Microsoft. All rights reserved.
+ * Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+ *
+ * =+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+
+ *
+ * HTTP Library: WinHttpQueryCallbackStats.
+ *
+ * =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+ ****/
+#include "test_common.h"
+
+static const int REQUESTS = 6;
+
+static ULONGLONG Sum(const ULONGLONG *buckets)
+{
+    ULONGLONG total = 0;
+
+    for (int i = 0; i < WINHTTP_CALLBACK_STATS_BUCKETS; i++)
+        total += buckets[i];
+    return total;
+}
+
+static WINHTTP_CALLBACK_STATS Query(DWORD dwInternetStatus)
+{
+    WINHTTP_CALLBACK_STATS stats;
+
+    memset(&stats, 0, sizeof(stats));
+    stats.dwInternetStatus = dwInternetStatus;
+    CHECK(WinHttpQueryCallbackStats(&stats));
+    CHECK(stats.dwInternetStatus == dwInternetStatus);
+    return stats;
+}
+
+int main()
+{
+    test::LoopbackServer server;
+    test::Transfer transfers[REQUESTS];
+    HINTERNET requests[REQUESTS];
+    WINHTTP_CALLBACK_STATS stats;
+
+    // a single status or all of them
+    CHECK(!WinHttpQueryCallbackStats(NULL));
+    memset(&stats, 0, sizeof(stats));
+    stats.dwInternetStatus = WINHTTP_CALLBACK_STATUS_READ_COMPLETE | WINHTTP_CALLBACK_STATUS_HEADERS_AVAILABLE;
+    CHECK(!WinHttpQueryCallbackStats(&stats));
+
+    HINTERNET session = WinHttpOpen("test", 0, NULL, NULL, WINHTTP_FLAG_ASYNC);
+    WinHttpSetStatusCallback(session, test::ReadToEndCallback, WINHTTP_CALLBACK_FLAG_ALL_NOTIFICATIONS, 0);
+    HINTERNET connect = WinHttpConnect(session, "127.0.0.1", server.GetPort(), 0);
+    CHECK(connect);
+
+    for (int i = 0; i < REQUESTS; i++)
+    {
+        requests[i] = WinHttpOpenRequest(connect, "GET", "/bytes/50000", NULL, NULL, NULL, 0);
+        CHECK(WinHttpSendRequest(requests[i], NULL, 0, NULL, 0, 0, reinterpret_cast<DWORD_PTR>(&transfers[i])));
+    }
+
+    for (int i = 0; i < REQUESTS; i++)
+    {
+        CHECK(transfers[i].m_Done.Wait(10000));
+        CHECK(transfers[i].m_Error == ERROR_SUCCESS);
+        WinHttpCloseHandle(requests[i]);
+    }
+    for (int i = 0; i < REQUESTS; i++)
+        CHECK(test::WaitFor([&] { return transfers[i].m_Closing.load(); }, 5000));
+
+    // every notification raised is dispatched or discarded, nothing is left queued once all closed
+    CHECK(test::WaitFor([] { return Query(0).ullQueueDepth == 0; }, 5000));
+
+    stats = Query(0);
+    CHECK(stats.ullMaxQueueDepth >= 1);
+    CHECK(stats.ullDiscarded == 0);
+    CHECK(Sum(stats.ullQueueWaitUs) == stats.ullDispatched);
+    CHECK(Sum(stats.ullExecutionUs) == stats.ullDispatched);
+
+    WINHTTP_CALLBACK_STATS headers = Query(WINHTTP_CALLBACK_STATUS_HEADERS_AVAILABLE);
+    CHECK(headers.ullDispatched == REQUESTS);
+    CHECK(Sum(headers.ullQueueWaitUs) == REQUESTS);
+
+    // at least one data read and the final empty one per request
+    WINHTTP_CALLBACK_STATS reads = Query(WINHTTP_CALLBACK_STATUS_READ_COMPLETE);
+    CHECK(reads.ullDispatched >= 2 * REQUESTS);
+    CHECK(Query(WINHTTP_CALLBACK_STATUS_HANDLE_CLOSING).ullDispatched >= REQUESTS);
+    CHECK(stats.ullDispatched >= headers.ullDispatched + reads.ullDispatched);
+
+    WinHttpCloseHandle(connect);
+    WinHttpCloseHandle(session);
+    return 0;
+}
@@ -0,0 +1,312 @@
+/***
+ * Copyright (C) Microsoft. All rights reserved.
+ * Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+ *
+ * =+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+
+ *
+ * HTTP Library: test helpers.
+ *
+ * A loopback HTTP/1.1 server on an ephemeral port, and a status callback that reads a response to
+ * its end. Every test is a separate program that returns non-zero on the first failed CHECK.
+ *
+ *   GET /bytes/N     N body bytes of BodyByte(i)
+ *   GET /delay/MS    an empty body after MS milliseconds
+ *   PUT|POST *       the length of the request body, in decimal
+ *
+ * =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+ ****/
+#pragma once
+
+#include "winhttppal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define CHECK(cond)                                                             \
+    do {                                                                        \
+        if (!(cond)) {                                                          \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed, errno:%d\n",              \
+                    __FILE__, __LINE__, #cond, errno);                          \
+            exit(1);                                                            \
+        }                                                                       \
+    } while (0)
+
+namespace test {
+
+inline char BodyByte(size_t i)
+{
+    return static_cast<char>((i * 31 + 7) & 0xff);
+}
+
+inline std::string ExpectedBody(size_t length)
+{
+    std::string body(length, '\0');
+
+    for (size_t i = 0; i < length; i++)
+        body[i] = BodyByte(i);
+    return body;
+}
+
+class Event
+{
+    std::mutex m_Mtx;
+    std::condition_variable m_Cv;
+    bool m_Set = false;
+
+public:
+    void Set()
+    {
+        std::lock_guard<std::mutex> lck(m_Mtx);
+        m_Set = true;
+        m_Cv.notify_all();
+    }
+
+    bool Wait(int timeoutMs)
+    {
+        std::unique_lock<std::mutex> lck(m_Mtx);
+        return m_Cv.wait_for(lck, std::chrono::milliseconds(timeoutMs), [this] { return m_Set; });
+    }
+};
+
+class LoopbackServer
+{
+    int m_Listen = -1;
+    int m_Port = 0;
+    std::thread m_Acceptor;
+    std::mutex m_Mtx;
+    std::vector<int> m_Clients;
+    std::vector<std::thread> m_Workers;
+    std::atomic<int> m_Requests{0};
+
+    static bool SendAll(int fd, const char *data, size_t len)
+    {
+        while (len)
+        {
+            ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+
+            if (sent <= 0)
+                return false;
+            data += sent;
+            len -= sent;
+        }
+        return true;
+    }
+
+    static bool Respond(int fd, const std::string &body)
+    {
+        std::string head = "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: " +
+                           std::to_string(body.size()) + "\r\n\r\n";
+
+        return SendAll(fd, head.data(), head.size()) && SendAll(fd, body.data(), body.size());
+    }
+
+    static std::string Header(const std::string &head, const char *name)
+    {
+        std::string lower = head;
+        std::string key = std::string("\r\n") + name + ":";
+
+        for (char &c : lower)
+            c = static_cast<char>(tolower(c));
+
+        size_t pos = lower.find(key);
+        if (pos == std::string::npos)
+            return std::string();
+
+        size_t begin = head.find_first_not_of(' ', pos + key.size());
+        return head.substr(begin, head.find("\r\n", begin) - begin);
+    }
+
+    void Serve(int fd)
+    {
+        std::string pending;
+        char buf[65536];
+
+        while (true)
+        {
+            size_t end;
+
+            while ((end = pending.find("\r\n\r\n")) == std::string::npos)
+            {
+                ssize_t got = recv(fd, buf, sizeof(buf), 0);
+                if (got <= 0)
+                    return;
+                pending.append(buf, got);
+            }
+
+            std::string head = pending.substr(0, end + 2);
+            std::string method = head.substr(0, head.find(' '));
+            std::string path = head.substr(method.size() + 1, head.find(' ', method.size() + 1) - method.size() - 1);
+            std::string length = Header(head, "content-length");
+            size_t bodyLength = length.empty() ? 0 : std::stoul(length);
+
+            pending.erase(0, end + 4);
+            m_Requests++;
+
+            if (!Header(head, "expect").empty() && (pending.size() < bodyLength))
+            {
+                static const char cont[] = "HTTP/1.1 100 Continue\r\n\r\n";
+                if (!SendAll(fd, cont, sizeof(cont) - 1))
+                    return;
+            }
+
+            while (pending.size() < bodyLength)
+            {
+                ssize_t got = recv(fd, buf, sizeof(buf), 0);
+                if (got <= 0)
+                    return;
+                pending.append(buf, got);
+            }
+            pending.erase(0, bodyLength);
+
+            std::string body;
+            if ((method == "PUT") || (method == "POST"))
+                body = std::to_string(bodyLength);
+            else if (path.compare(0, 7, "/bytes/") == 0)
+                body = ExpectedBody(std::stoul(path.substr(7)));
+            else if (path.compare(0, 7, "/delay/") == 0)
+                std::this_thread::sleep_for(std::chrono::milliseconds(std::stoul(path.substr(7))));
+
+            if (!Respond(fd, body))
+                return;
+        }
+    }
+
+    void Accept()
+    {
+        while (true)
+        {
+            int fd = accept(m_Listen, NULL, NULL);
+            if (fd < 0)
+                return;
+
+            std::lock_guard<std::mutex> lck(m_Mtx);
+            m_Clients.push_back(fd);
+            m_Workers.emplace_back(&LoopbackServer::Serve, this, fd);
+        }
+    }
+
+public:
+    LoopbackServer()
+    {
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        int one = 1;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        m_Listen = socket(AF_INET, SOCK_STREAM, 0);
+        CHECK(m_Listen >= 0);
+        setsockopt(m_Listen, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        CHECK(bind(m_Listen, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == 0);
+        CHECK(listen(m_Listen, 128) == 0);
+        CHECK(getsockname(m_Listen, reinterpret_cast<struct sockaddr *>(&addr), &len) == 0);
+        m_Port = ntohs(addr.sin_port);
+
+        m_Acceptor = std::thread(&LoopbackServer::Accept, this);
+    }
+
+    ~LoopbackServer()
+    {
+        shutdown(m_Listen, SHUT_RDWR);
+        m_Acceptor.join();
+        close(m_Listen);
+
+        for (int fd : m_Clients)
+            shutdown(fd, SHUT_RDWR);
+        for (std::thread &worker : m_Workers)
+            worker.join();
+        for (int fd : m_Clients)
+            close(fd);
+    }
+
+    INTERNET_PORT GetPort() const { return static_cast<INTERNET_PORT>(m_Port); }
+    int GetRequests() const { return m_Requests; }
+};
+
+template <typename Predicate>
+bool WaitFor(Predicate predicate, int timeoutMs)
+{
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+
+    while (!predicate())
+    {
+        if (std::chrono::steady_clock::now() >= deadline)
+            return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    return true;
+}
+
+// dwContext of a request read with ReadToEndCallback, has to outlive its HANDLE_CLOSING
+struct Transfer
+{
+    std::string m_Body;
+    DWORD m_Error = ERROR_SUCCESS;
+    std::atomic<bool> m_Closing{false};
+    Event m_Done;
+    char m_Buffer[16384];
+};
+
+// async status callback: receive the response, read the body to its end and set m_Done
+inline VOID CALLBACK ReadToEndCallback(HINTERNET hRequest, DWORD_PTR dwContext, DWORD dwInternetStatus,
+                                       LPVOID lpvStatusInformation, DWORD dwStatusInformationLength)
+{
+    Transfer *transfer = reinterpret_cast<Transfer *>(dwContext);
+
+    if (!transfer)
+        return;
+
+    switch (dwInternetStatus)
+    {
+    case WINHTTP_CALLBACK_STATUS_SENDREQUEST_COMPLETE:
+        if (!WinHttpReceiveResponse(hRequest, NULL))
+        {
+            transfer->m_Error = GetLastError();
+            transfer->m_Done.Set();
+        }
+        break;
+    case WINHTTP_CALLBACK_STATUS_HEADERS_AVAILABLE:
+        if (!WinHttpReadData(hRequest, transfer->m_Buffer, sizeof(transfer->m_Buffer), NULL))
+        {
+            transfer->m_Error = GetLastError();
+            transfer->m_Done.Set();
+        }
+        break;
+    case WINHTTP_CALLBACK_STATUS_READ_COMPLETE:
+        if (!dwStatusInformationLength)
+        {
+            transfer->m_Done.Set();
+            break;
+        }
+        transfer->m_Body.append(transfer->m_Buffer, dwStatusInformationLength);
+        if (!WinHttpReadData(hRequest, transfer->m_Buffer, sizeof(transfer->m_Buffer), NULL))
+        {
+            transfer->m_Error = GetLastError();
+            transfer->m_Done.Set();
+        }
+        break;
+    case WINHTTP_CALLBACK_STATUS_REQUEST_ERROR:
+        transfer->m_Error = static_cast<WINHTTP_ASYNC_RESULT *>(lpvStatusInformation)->dwError;
+        transfer->m_Done.Set();
+        break;
+    case WINHTTP_CALLBACK_STATUS_HANDLE_CLOSING:
+        transfer->m_Closing = true;
+        break;
+    }
+}
+
+} // namespace test
@@ -0,0 +1,168 @@
+/***
+ * Copyright (C) Microsoft. All rights reserved.
+ * Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+ *
+ * =+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+
+ *
+ * HTTP Library: a session driven by the caller's event loop, WinHttpProcessSocket/WinHttpProcessTimeout.
+ *
+ * =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+ ****/
+#include "test_common.h"
+
+#include <sys/epoll.h>
+
+static const int REQUESTS = 4;
+
+struct EventLoop
+{
+    int m_Epoll = -1;
+    std::chrono::steady_clock::time_point m_Deadline;
+    bool m_TimerArmed = false;
+    int m_Timeouts = 0;
+    std::thread::id m_Thread;
+    bool m_ForeignCall = false;
+};
+
+static VOID SocketCallback(LPVOID pContext, int fd, DWORD dwEvents)
+{
+    EventLoop *loop = static_cast<EventLoop *>(pContext);
+    struct epoll_event ev;
+
+    if (std::this_thread::get_id() != loop->m_Thread)
+        loop->m_ForeignCall = true;
+
+    if (dwEvents & WINHTTP_EVENT_LOOP_REMOVE)
+    {
+        epoll_ctl(loop->m_Epoll, EPOLL_CTL_DEL, fd, NULL);
+        return;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.data.fd = fd;
+    if (dwEvents & WINHTTP_EVENT_LOOP_IN)
+        ev.events |= EPOLLIN;
+    if (dwEvents & WINHTTP_EVENT_LOOP_OUT)
+        ev.events |= EPOLLOUT;
+
+    if (epoll_ctl(loop->m_Epoll, EPOLL_CTL_MOD, fd, &ev) != 0)
+        CHECK(epoll_ctl(loop->m_Epoll, EPOLL_CTL_ADD, fd, &ev) == 0);
+}
+
+static VOID TimerCallback(LPVOID pContext, long lTimeoutMs)
+{
+    EventLoop *loop = static_cast<EventLoop *>(pContext);
+
+    loop->m_TimerArmed = (lTimeoutMs >= 0);
+    if (loop->m_TimerArmed)
+        loop->m_Deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(lTimeoutMs);
+}
+
+static void RunOnce(EventLoop &loop, HINTERNET session)
+{
+    struct epoll_event events[16];
+    int n = epoll_wait(loop.m_Epoll, events, 16, 5);
+
+    for (int i = 0; i < n; i++)
+    {
+        DWORD dwEvents = 0;
+
+        if (events[i].events & EPOLLIN)
+            dwEvents |= WINHTTP_EVENT_LOOP_IN;
+        if (events[i].events & EPOLLOUT)
+            dwEvents |= WINHTTP_EVENT_LOOP_OUT;
+        if (events[i].events & (EPOLLERR | EPOLLHUP))
+            dwEvents |= WINHTTP_EVENT_LOOP_ERROR;
+        CHECK(WinHttpProcessSocket(session, events[i].data.fd, dwEvents));
+    }
+
+    if (loop.m_TimerArmed && (std::chrono::steady_clock::now() >= loop.m_Deadline))
+    {
+        loop.m_TimerArmed = false;
+        loop.m_Timeouts++;
+        CHECK(WinHttpProcessTimeout(session));
+    }
+}
+
+int main()
+{
+    test::LoopbackServer server;
+    test::Transfer transfers[REQUESTS];
+    HINTERNET requests[REQUESTS];
+    EventLoop loop;
+
+    loop.m_Epoll = epoll_create1(0);
+    loop.m_Thread = std::this_thread::get_id();
+    CHECK(loop.m_Epoll >= 0);
+
+    HINTERNET session = WinHttpOpen("test", 0, NULL, NULL, WINHTTP_FLAG_ASYNC);
+    CHECK(session);
+    WinHttpSetStatusCallback(session, test::ReadToEndCallback, WINHTTP_CALLBACK_FLAG_ALL_NOTIFICATIONS, 0);
+
+    // delivered on the loop's thread, from inside WinHttpProcessSocket/WinHttpProcessTimeout
+    DWORD inlineCallbacks = 1;
+    CHECK(WinHttpSetOption(session, WINHTTP_OPTION_INLINE_CALLBACKS, &inlineCallbacks, sizeof(inlineCallbacks)));
+
+    WINHTTP_EVENT_LOOP_CALLBACKS callbacks = { SocketCallback, TimerCallback, &loop };
+    CHECK(WinHttpSetOption(session, WINHTTP_OPTION_EVENT_LOOP_CALLBACKS, &callbacks, sizeof(callbacks)));
+
+    // a session without its own engine has nothing to drive
+    HINTERNET threaded = WinHttpOpen("test", 0, NULL, NULL, WINHTTP_FLAG_ASYNC);
+    CHECK(!WinHttpProcessSocket(threaded, 0, WINHTTP_EVENT_LOOP_IN));
+    CHECK(!WinHttpProcessTimeout(threaded));
+    WinHttpCloseHandle(threaded);
+
+    HINTERNET connect = WinHttpConnect(session, "127.0.0.1", server.GetPort(), 0);
+    CHECK(connect);
+
+    for (int i = 0; i < REQUESTS; i++)
+    {
+        std::string path = "/bytes/" + std::to_string(100000 * (i + 1));
+
+        requests[i] = WinHttpOpenRequest(connect, "GET", path.c_str(), NULL, NULL, NULL, 0);
+        CHECK(requests[i]);
+        CHECK(WinHttpSendRequest(requests[i], NULL, 0, NULL, 0, 0, reinterpret_cast<DWORD_PTR>(&transfers[i])));
+    }
+
+    bool done = false;
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::seconds(20);
+
+    while (!done && (std::chrono::steady_clock::now() < deadline))
+    {
+        RunOnce(loop, session);
+
+        done = true;
+        for (int i = 0; i < REQUESTS; i++)
+            done = done && transfers[i].m_Done.Wait(0);
+    }
+    CHECK(done);
+
+    for (int i = 0; i < REQUESTS; i++)
+    {
+        CHECK(transfers[i].m_Error == ERROR_SUCCESS);
+        CHECK(transfers[i].m_Body == test::ExpectedBody(100000 * (i + 1)));
+    }
+    CHECK(loop.m_Timeouts > 0);
+    CHECK(!loop.m_ForeignCall);
+
+    for (int i = 0; i < REQUESTS; i++)
+        WinHttpCloseHandle(requests[i]);
+
+    // HANDLE_CLOSING is raised from the loop as well
+    done = false;
+    deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (!done && (std::chrono::steady_clock::now() < deadline))
+    {
+        RunOnce(loop, session);
+
+        done = true;
+        for (int i = 0; i < REQUESTS; i++)
+            done = done && transfers[i].m_Closing;
+    }
+    CHECK(done);
+
+    WinHttpCloseHandle(connect);
+    WinHttpCloseHandle(session);
+    close(loop.m_Epoll);
+    return 0;
+}
@@ -0,0 +1,63 @@
+/***
+ * Copyright (C) Microsoft. All rights reserved.
+ * Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+ *
+ * =+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+
+ *
+ * HTTP Library: sends spaced apart, each one has to wake an engine that went idle.
+ *
+ * =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+ ****/
+#include "test_common.h"
+
+static void Fetch(HINTERNET connect, size_t length)
+{
+    test::Transfer transfer;
+    std::string path = "/bytes/" + std::to_string(length);
+    HINTERNET request = WinHttpOpenRequest(connect, "GET", path.c_str(), NULL, NULL, NULL, 0);
+
+    CHECK(request);
+    CHECK(WinHttpSendRequest(request, NULL, 0, NULL, 0, 0, reinterpret_cast<DWORD_PTR>(&transfer)));
+
+    // well below any timeout of the transfer itself, a lost wakeup shows up as a stall
+    CHECK(transfer.m_Done.Wait(5000));
+    CHECK(transfer.m_Error == ERROR_SUCCESS);
+    CHECK(transfer.m_Body == test::ExpectedBody(length));
+
+    WinHttpCloseHandle(request);
+    CHECK(test::WaitFor([&] { return transfer.m_Closing.load(); }, 5000));
+}
+
+int main()
+{
+    static const int GAPS_MS[] = { 0, 10, 300, 1200, 0 };
+    test::LoopbackServer server;
+
+    HINTERNET session = WinHttpOpen("test", 0, NULL, NULL, WINHTTP_FLAG_ASYNC);
+    WinHttpSetStatusCallback(session, test::ReadToEndCallback, WINHTTP_CALLBACK_FLAG_ALL_NOTIFICATIONS, 0);
+    HINTERNET connect = WinHttpConnect(session, "127.0.0.1", server.GetPort(), 0);
+    CHECK(connect);
+
+    Fetch(connect, 1000);
+    for (int gap : GAPS_MS)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(gap));
+        Fetch(connect, 50000);
+    }
+
+    // a request that is slow to answer, the engine sleeps on its socket rather than a command
+    test::Transfer delayed;
+    HINTERNET request = WinHttpOpenRequest(connect, "GET", "/delay/500", NULL, NULL, NULL, 0);
+    CHECK(WinHttpSendRequest(request, NULL, 0, NULL, 0, 0, reinterpret_cast<DWORD_PTR>(&delayed)));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    Fetch(connect, 2000);
+    CHECK(delayed.m_Done.Wait(5000));
+    CHECK(delayed.m_Error == ERROR_SUCCESS);
+    CHECK(delayed.m_Body.empty());
+    WinHttpCloseHandle(request);
+    CHECK(test::WaitFor([&] { return delayed.m_Closing.load(); }, 5000));
+
+    WinHttpCloseHandle(connect);
+    WinHttpCloseHandle(session);
+    return 0;
+}
@@ -0,0 +1,175 @@
+/***
+ * Copyright (C) Microsoft. All rights reserved.
+ * Licensed under the MIT license. See LICENSE.txt file in the project root for full license information.
+ *
+ * =+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+=+
+ *
+ * HTTP Library: WINHTTP_OPTION_RESPONSE_SINK_FD and WINHTTP_OPTION_RESPONSE_SINK_PATH.
+ *
+ * =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+ ****/
+#include "test_common.h"
+
+#include <fcntl.h>
+
+struct SinkTransfer
+{
+    WINHTTP_SINK_RESULT m_Result;
+    std::atomic<int> m_Other{0};
+    test::Event m_Done;
+};
+
+static VOID CALLBACK SinkCallback(HINTERNET hRequest, DWORD_PTR dwContext, DWORD dwInternetStatus,
+                                  LPVOID lpvStatusInformation, DWORD)
+{
+    SinkTransfer *transfer = reinterpret_cast<SinkTransfer *>(dwContext);
+
+    if (!transfer)
+        return;
+
+    switch (dwInternetStatus)
+    {
+    case WINHTTP_CALLBACK_STATUS_SENDREQUEST_COMPLETE:
+        WinHttpReceiveResponse(hRequest, NULL);
+        break;
+    case WINHTTP_CALLBACK_STATUS_SINK_COMPLETE:
+        transfer->m_Result = *static_cast<WINHTTP_SINK_RESULT *>(lpvStatusInformation);
+        transfer->m_Done.Set();
+        break;
+    case WINHTTP_CALLBACK_STATUS_DATA_AVAILABLE:
+    case WINHTTP_CALLBACK_STATUS_READ_COMPLETE:
+    case WINHTTP_CALLBACK_STATUS_REQUEST_ERROR:
+        transfer->m_Other++;
+        break;
+    }
+}
+
+static std::string ReadFile(const std::string &path)
+{
+    std::string content;
+    char buf[65536];
+    int fd = open(path.c_str(), O_RDONLY);
+    ssize_t got;
+
+    CHECK(fd >= 0);
+    while ((got = read(fd, buf, sizeof(buf))) > 0)
+        content.append(buf, got);
+    close(fd);
+    return content;
+}
+
+static std::string TempPath(const char *name)
+{
+    const char *dir = getenv("TMPDIR");
+
+    return std::string(dir ? dir : "/tmp") + "/winhttppal_" + name + "_" + std::to_string(getpid());
+}
+
+static HINTERNET Send(HINTERNET connect, const char *path, DWORD option, LPVOID value, DWORD length, SinkTransfer &transfer)
+{
+    HINTERNET request = WinHttpOpenRequest(connect, "GET", path, NULL, NULL, NULL, 0);
+
+    CHECK(request);
+    CHECK(WinHttpSetOption(request, option, value, length));
+    CHECK(WinHttpSendRequest(request, NULL, 0, NULL, 0, 0, reinterpret_cast<DWORD_PTR>(&transfer)));
+    return request;
+}
+
+int main()
+{
+    test::LoopbackServer server;
+    std::string filePath = TempPath("path");
+    std::string fdPath = TempPath("fd");
+
+    HINTERNET session = WinHttpOpen("test", 0, NULL, NULL, WINHTTP_FLAG_ASYNC);
+    WinHttpSetStatusCallback(session, SinkCallback, WINHTTP_CALLBACK_FLAG_ALL_NOTIFICATIONS, 0);
+    HINTERNET connect = WinHttpConnect(session, "127.0.0.1", server.GetPort(), 0);
+    CHECK(connect);
+
+    // a file the library opens and closes
+    SinkTransfer byPath;
+    HINTERNET request = Send(connect, "/bytes/1234567", WINHTTP_OPTION_RESPONSE_SINK_PATH,
+                             const_cast<char *>(filePath.c_str()), static_cast<DWORD>(filePath.size()), byPath);
+    CHECK(byPath.m_Done.Wait(10000));
+    CHECK(byPath.m_Result.dwError == ERROR_SUCCESS);
+    CHECK(byPath.m_Result.dwSystemError == 0);
+    CHECK(byPath.m_Result.ullBytesWritten == 1234567);
+    CHECK(byPath.m_Other == 0);
+    WinHttpCloseHandle(request);
+    CHECK(ReadFile(filePath) == test::ExpectedBody(1234567));
+
+    // the caller's descriptor stays open
+    SinkTransfer byFd;
+    int fd = open(fdPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CHECK(fd >= 0);
+    request = Send(connect, "/bytes/200000", WINHTTP_OPTION_RESPONSE_SINK_FD, &fd, sizeof(fd), byFd);
+    CHECK(byFd.m_Done.Wait(10000));
+    CHECK(byFd.m_Result.dwError == ERROR_SUCCESS);
+    CHECK(byFd.m_Result.ullBytesWritten == 200000);
+    WinHttpCloseHandle(request);
+    CHECK(write(fd, "x", 1) == 1);
+    close(fd);
+    CHECK(ReadFile(fdPath) == test::ExpectedBody(200000) + "x");
+
+    // a failed write ends the transfer, the errno comes separately
+    SinkTransfer failing;
+    int readOnly = open("/dev/null", O_RDONLY);
+    request = Send(connect, "/bytes/200000", WINHTTP_OPTION_RESPONSE_SINK_FD, &readOnly, sizeof(readOnly), failing);
+    CHECK(failing.m_Done.Wait(10000));
+    CHECK(failing.m_Result.dwError == ERROR_WRITE_FAULT);
+    CHECK(failing.m_Result.dwSystemError == EBADF);
+    CHECK(failing.m_Result.ullBytesWritten == 0);
+    CHECK(failing.m_Other == 0);
+    WinHttpCloseHandle(request);
+    close(readOnly);
+
+    // a sink nobody drains must not hold up the other transfers of the engine
+    SinkTransfer stalled;
+    SinkTransfer other;
+    int pipes[2];
+    CHECK(pipe(pipes) == 0);
+    HINTERNET stalledRequest = Send(connect, "/bytes/3000000", WINHTTP_OPTION_RESPONSE_SINK_FD, &pipes[1], sizeof(pipes[1]), stalled);
+    CHECK(!stalled.m_Done.Wait(300));
+
+    fd = open(fdPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    request = Send(connect, "/bytes/100000", WINHTTP_OPTION_RESPONSE_SINK_FD, &fd, sizeof(fd), other);
+    CHECK(other.m_Done.Wait(10000));
+    CHECK(other.m_Result.dwError == ERROR_SUCCESS);
+    CHECK(other.m_Result.ullBytesWritten == 100000);
+    WinHttpCloseHandle(request);
+    close(fd);
+
+    std::string drained;
+    char buf[65536];
+    while (drained.size() < 3000000)
+    {
+        ssize_t got = read(pipes[0], buf, sizeof(buf));
+        CHECK(got > 0);
+        drained.append(buf, got);
+    }
+    CHECK(stalled.m_Done.Wait(10000));
+    CHECK(stalled.m_Result.dwError == ERROR_SUCCESS);
+    CHECK(stalled.m_Result.ullBytesWritten == 3000000);
+    CHECK(drained == test::ExpectedBody(3000000));
+    WinHttpCloseHandle(stalledRequest);
+    close(pipes[0]);
+    close(pipes[1]);
+
+    // sync requests write on the caller's thread
+    HINTERNET syncSession = WinHttpOpen("test", 0, NULL, NULL, 0);
+    HINTERNET syncConnect = WinHttpConnect(syncSession, "127.0.0.1", server.GetPort(), 0);
+    request = WinHttpOpenRequest(syncConnect, "GET", "/bytes/500000", NULL, NULL, NULL, 0);
+    CHECK(WinHttpSetOption(request, WINHTTP_OPTION_RESPONSE_SINK_PATH, const_cast<char *>(filePath.c_str()),
+                           static_cast<DWORD>(filePath.size())));
+    CHECK(WinHttpSendRequest(request, NULL, 0, NULL, 0, 0, 0));
+    WinHttpCloseHandle(request);
+    CHECK(ReadFile(filePath) == test::ExpectedBody(500000));
+
+    WinHttpCloseHandle(syncConnect);
+    WinHttpCloseHandle(syncSession);
+    WinHttpCloseHandle(connect);
+    WinHttpCloseHandle(session);
+    unlink(filePath.c_str());
+    unlink(fdPath.c_str());
+    return 0;
+}